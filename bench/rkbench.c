@@ -0,0 +1,561 @@
+/* rkbench - throughput benchmarks for rkflashtool
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Every measurement is printed as one JSON object per line on stdout:
+ *
+ * {"suite":"crc","name":"rkcrc32","size":4096,"count":...,"bytes":...,
+ *  "seconds":...,"mb_s":...,"p50_us":...,"p90_us":...,"p99_us":...,
+ *  "max_us":...}
+ *
+ * count is the number of timed operations (CRC calls, rkunpack runs or
+ * flash commands) and the percentiles are their latencies. Progress goes
+ * to stderr, so the output can be kept and compared between releases.
+ */
+
+#define _XOPEN_SOURCE 700     /* nftw */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rkcrc.h"
+#include "rkflashtool.h"
+#include "librkflash.h"
+#include "version.h"
+
+#define PUT16LE(x, y) do { (x)[0] = (y) & 0xff; (x)[1] = ((y) >> 8) & 0xff; } while (0)
+
+static const char *const strings[2] = { "info", "fatal" };
+
+static void info_and_fatal(const int s, const char *f, ...) {
+    va_list ap;
+    va_start(ap,f);
+    fprintf(stderr, "rkbench: %s: ", strings[s]);
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+    if (s) exit(s);
+}
+
+#define info(...)   info_and_fatal(0, __VA_ARGS__)
+#define fatal(...)  info_and_fatal(1, __VA_ARGS__)
+
+/* command line */
+static int reps = 5;
+static unsigned int image_mb = 64;
+static double min_time = 0.5;
+static const char *emu_opts = "";
+static const char *rkunpack = "./rkunpack";
+static unsigned int xfer_size = RKFT_OFF_INCR;
+static char dir[PATH_MAX];
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Samples */
+
+struct samples {
+    double *t;
+    int n, max;
+};
+
+static void add(struct samples *s, double t) {
+    if (s->n == s->max) {
+        s->max = s->max ? s->max * 2 : 1024;
+        if (!(s->t = realloc(s->t, s->max * sizeof(*s->t))))
+            fatal("out of memory\n");
+    }
+    s->t[s->n++] = t;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(struct samples *s, double p) {
+    return s->n ? s->t[(int)(p * (s->n - 1) + 0.5)] * 1e6 : 0;
+}
+
+/* Prints one result line and empties the samples */
+static void report(const char *suite, const char *name, long long size,
+                   long long bytes, double seconds, struct samples *s) {
+    qsort(s->t, s->n, sizeof(*s->t), cmp_double);
+
+    printf("{\"suite\":\"%s\",\"name\":\"%s\",\"size\":%lld,\"count\":%d,"
+           "\"bytes\":%lld,\"seconds\":%.6f,\"mb_s\":%.2f,"
+           "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+           suite, name, size, s->n, bytes, seconds,
+           seconds > 0 ? bytes / seconds / 1e6 : 0,
+           percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99),
+           percentile(s, 1));
+    fflush(stdout);
+    info("%-8s %-16s %10lld bytes: %9.2f MB/s\n", suite, name, size,
+         seconds > 0 ? bytes / seconds / 1e6 : 0);
+    s->n = 0;
+}
+
+static void fill_random(uint8_t *p, size_t len, uint32_t seed) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        p[i] = seed >> 16;
+    }
+}
+
+/* CRC
+ *
+ * Each size runs for at least min_time. Small buffers are timed in
+ * batches of about 64kB so the clock does not dominate; a sample is the
+ * time of one call.
+ */
+
+static const unsigned int crc_sizes[] = {
+    64, 512, 4096, 65536, 1 << 20, 16 << 20
+};
+
+static volatile uint32_t crc_sink;
+
+static uint32_t crc32_dispatch(uint32_t crc, const uint8_t *buf, uint64_t size) {
+    return rkcrc32(crc, (uint8_t *)buf, size);
+}
+
+static uint32_t crc16(uint32_t crc, const uint8_t *buf, uint64_t size) {
+    return rkcrc16(crc, (uint8_t *)buf, size);
+}
+
+static void bench_crc_one(const char *name,
+                          uint32_t (*fn)(uint32_t, const uint8_t *, uint64_t),
+                          const uint8_t *buf) {
+    struct samples s = { 0 };
+    unsigned int i, k, batch;
+    long long bytes;
+    double t0, t, total;
+    uint32_t crc;
+
+    for (i = 0; i < sizeof(crc_sizes) / sizeof(*crc_sizes); i++) {
+        batch = crc_sizes[i] < 65536 ? 65536 / crc_sizes[i] : 1;
+        bytes = 0;
+        total = 0;
+        crc = 0;
+        do {
+            t0 = now();
+            for (k = 0; k < batch; k++)
+                crc = fn(crc, buf, crc_sizes[i]);
+            t = now() - t0;
+            add(&s, t / batch);
+            total += t;
+            bytes += (long long)batch * crc_sizes[i];
+        } while (total < min_time);
+        crc_sink = crc;
+        report("crc", name, crc_sizes[i], bytes, total, &s);
+    }
+    free(s.t);
+}
+
+/* rkcrc32 is what the tools use, rkcrc32_<variant> each implementation */
+static void bench_crc(void) {
+    size_t size = crc_sizes[sizeof(crc_sizes) / sizeof(*crc_sizes) - 1];
+    uint8_t *buf;
+#ifndef SLOW
+    const struct rkcrc32_variant *v;
+    char name[64];
+#endif
+
+    if (!(buf = malloc(size)))
+        fatal("out of memory\n");
+    fill_random(buf, size, 1);
+
+    bench_crc_one("rkcrc32", crc32_dispatch, buf);
+#ifndef SLOW
+    for (v = rkcrc32_list(); v->name; v++) {
+        snprintf(name, sizeof(name), "rkcrc32_%s", v->name);
+        bench_crc_one(name, v->fn, buf);
+    }
+#endif
+    bench_crc_one("rkcrc16", crc16, buf);
+    free(buf);
+}
+
+/* rkunpack
+ *
+ * Synthetic images of about image_mb MB are generated in the scratch
+ * directory and unpacked by the rkunpack binary, rep times each, in a
+ * fresh directory every time. A sample is one complete run.
+ */
+
+#define RKAF_FILES  6
+
+static const char *const rkaf_names[RKAF_FILES] = {
+    "parameter", "bootloader", "misc", "kernel", "boot", "system"
+};
+static const char *const rkaf_paths[RKAF_FILES] = {
+    "parameter", "RK3188Loader.bin", "Image/misc.img", "Image/kernel.img",
+    "Image/boot.img", "Image/system.img"
+};
+
+/* Lays out the RKAF files in p, returns the size of the image */
+static size_t make_rkaf(uint8_t *p, size_t size) {
+    uint8_t *e;
+    size_t off = 0x800, len;
+    int i;
+
+    memset(p, 0, 0x800);
+    memcpy(p, "RKAF", 4);
+    strcpy((char *)p + 0x08, "rkbench");
+    strcpy((char *)p + 0x48, "rkflashtool");
+    PUT32LE(p + 0x88, RKAF_FILES);
+
+    for (i = 0; i < RKAF_FILES; i++) {
+        e = p + 0x8c + i * 0x70;
+        /* small files first, system gets what is left */
+        len = i < RKAF_FILES - 1 ? (size >> 6) >> (RKAF_FILES - 1 - i)
+                                 : size - off - 4;
+        len = len < 0x200 ? 0x200 : len;
+        strcpy((char *)e, rkaf_names[i]);
+        strcpy((char *)e + 0x20, rkaf_paths[i]);
+        PUT32LE(e + 0x60, off);
+        PUT32LE(e + 0x64, 0);
+        PUT32LE(e + 0x68, (len + 0x7ff) & ~0x7ff);
+        PUT32LE(e + 0x6c, len);
+        fill_random(p + off, len, i + 1);
+        if (i == 0) {
+            memcpy(p + off, "PARM", 4);
+            PUT32LE(p + off + 4, len - 12);
+        }
+        off += i < RKAF_FILES - 1 ? (len + 0x7ff) & ~0x7ff : len;
+    }
+    PUT32LE(p + 4, off);
+    PUT32LE(p + off, rkcrc32(0, p, off));
+    return off + 4;
+}
+
+static size_t make_rkfw(uint8_t *p, size_t size) {
+    size_t boot = 0x40000, rkaf;
+
+    memset(p, 0, 0x66);
+    memcpy(p, "RKFW", 4);
+    PUT16LE(p + 4, 0x66);
+    p[6] = 0; p[7] = 0; p[8] = 1; p[9] = 4;     /* 4.1.0 */
+    PUT16LE(p + 0x0e, 2014);
+    p[0x10] = 1; p[0x11] = 1;
+    p[0x15] = 0x70;
+    PUT32LE(p + 0x19, 0x66);
+    PUT32LE(p + 0x1d, boot);
+    fill_random(p + 0x66, boot, 42);
+    memcpy(p + 0x66, "BOOT", 4);
+
+    rkaf = make_rkaf(p + 0x66 + boot, size - 0x66 - boot - 32);
+    PUT32LE(p + 0x21, 0x66 + boot);
+    PUT32LE(p + 0x25, rkaf);
+    return 0x66 + boot + rkaf;
+}
+
+static size_t make_rkfp(uint8_t *p, size_t size) {
+    uint8_t *e;
+    unsigned int i, pss = 512, pes = 128, sector = 8, len;
+
+    memset(p, 0, 8 * pss);
+    memcpy(p, "RKFP", 4);
+    PUT16LE(p + 4, 2014);
+    p[6] = 1; p[7] = 1;
+    p[14] = 1; p[15] = 4;
+    PUT32LE(p + 0x10, pss);
+    PUT32LE(p + 0x14, 1);
+    PUT32LE(p + 0x18, 4);
+    PUT32LE(p + 0x1c, pes);
+    PUT32LE(p + 0x20, RKAF_FILES);
+
+    for (i = 0; i < RKAF_FILES; i++) {
+        e = p + pss + i * pes;
+        len = i < RKAF_FILES - 1 ? (size >> 6) >> (RKAF_FILES - 1 - i)
+                                 : size - sector * pss;
+        len = len / pss * pss;
+        snprintf((char *)e, 32, "%s.img", rkaf_names[i]);
+        PUT32LE(e + 32, i);
+        PUT32LE(e + 36, sector);
+        PUT32LE(e + 40, len / pss);
+        PUT32LE(e + 44, len);
+        fill_random(p + sector * pss, len, i + 1);
+        sector += len / pss;
+    }
+    PUT32LE(p + 0x24, sector * pss);
+    return (size_t)sector * pss;
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag,
+                      struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+static void bench_unpack_one(const char *name, size_t (*make)(uint8_t *, size_t)) {
+    struct samples s = { 0 };
+    char image[PATH_MAX + 16], run[PATH_MAX + 16];
+    uint8_t *buf;
+    size_t size = (size_t)image_mb << 20, len;
+    double t0, t, total = 0;
+    int fd, i, status;
+    pid_t pid;
+
+    if (!(buf = malloc(size)))
+        fatal("out of memory\n");
+    len = make(buf, size);
+
+    snprintf(image, sizeof(image), "%s/%s.img", dir, name);
+    if ((fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+        write(fd, buf, len) != (ssize_t)len || close(fd))
+        fatal("%s: %s\n", image, strerror(errno));
+    free(buf);
+
+    snprintf(run, sizeof(run), "%s/unpack", dir);
+    for (i = 0; i < reps; i++) {
+        nftw(run, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+        if (mkdir(run, 0755))
+            fatal("%s: %s\n", run, strerror(errno));
+
+        t0 = now();
+        if ((pid = fork()) == -1)
+            fatal("fork: %s\n", strerror(errno));
+        if (!pid) {
+            if (chdir(run) || !freopen("/dev/null", "w", stdout) ||
+                !freopen("/dev/null", "w", stderr))
+                _exit(127);
+            execl(rkunpack, rkunpack, image, (char *)NULL);
+            _exit(127);
+        }
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status))
+            fatal("%s failed on %s\n", rkunpack, image);
+        t = now() - t0;
+        add(&s, t);
+        total += t;
+    }
+    nftw(run, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    unlink(image);
+
+    report("unpack", name, len, (long long)len * reps, total, &s);
+    free(s.t);
+}
+
+static void bench_unpack(void) {
+    static char path[PATH_MAX];
+
+    /* it runs in another directory */
+    if (access(rkunpack, X_OK) || !realpath(rkunpack, path))
+        fatal("%s: %s (use -u)\n", rkunpack, strerror(errno));
+    rkunpack = path;
+
+    bench_unpack_one("rkaf", make_rkaf);
+    bench_unpack_one("rkfw", make_rkfw);
+    bench_unpack_one("rkfp", make_rkfp);
+}
+
+/* Flash
+ *
+ * The read, write and erase loops run against an emulated device backed
+ * by a sparse file in the scratch directory, with the options of -e. A
+ * sample is one flash command (one erase block for erase).
+ */
+
+#define FLASH_OFFSET 0x2000
+
+struct read_state {
+    struct samples *s;
+    double t;
+};
+
+static int read_block(void *user, int offset, uint8_t *data, int nsectors) {
+    struct read_state *r = user;
+    double t = now();
+
+    (void)offset; (void)data; (void)nsectors;
+    add(r->s, t - r->t);
+    r->t = t;
+    return 0;
+}
+
+static void bench_flash(void) {
+    struct samples s = { 0 };
+    struct read_state rs;
+    char image[PATH_MAX + 16], spec[2 * PATH_MAX];
+    rkflash f;
+    uint8_t *buf;
+    nand_info nand;
+    int nsectors = image_mb << 11, off, n, bs, i, r;
+    long long bytes = (long long)nsectors << 9;
+    double t0, t, total;
+
+    snprintf(image, sizeof(image), "%s/flash.img", dir);
+    snprintf(spec, sizeof(spec), "%s,size=%d%s%s", image,
+             FLASH_OFFSET + nsectors, *emu_opts ? "," : "", emu_opts);
+
+    memset(&f, 0, sizeof(f));
+    if ((r = rkflash_open_emulator(&f, spec, "emu0")))
+        fatal("%s: %s\n", spec, rkflash_strerror(r));
+    f.xfer_size = xfer_size;
+    if ((r = rkflash_flash_info(&f, &nand)))
+        fatal("flash info: %s\n", rkflash_strerror(r));
+    bs = nand.block_size;
+
+    if (!(buf = malloc((size_t)xfer_size << 9)))
+        fatal("out of memory\n");
+    fill_random(buf, (size_t)xfer_size << 9, 7);
+
+    for (i = 0, total = 0; i < reps; i++) {
+        for (off = 0; off < nsectors; off += n) {
+            n = nsectors - off < (int)xfer_size ? nsectors - off : (int)xfer_size;
+            t0 = now();
+            if ((r = rkflash_write_lba(&f, FLASH_OFFSET + off, n, buf)))
+                fatal("write: %s\n", rkflash_strerror(r));
+            t = now() - t0;
+            add(&s, t);
+            total += t;
+        }
+    }
+    report("flash", "write_lba", (long long)xfer_size << 9, bytes * reps, total, &s);
+
+    for (i = 0, total = 0; i < reps; i++) {
+        for (off = 0; off < nsectors; off += n) {
+            n = nsectors - off < (int)xfer_size ? nsectors - off : (int)xfer_size;
+            t0 = now();
+            if ((r = rkflash_read_lba(&f, FLASH_OFFSET + off, n, buf)))
+                fatal("read: %s\n", rkflash_strerror(r));
+            t = now() - t0;
+            add(&s, t);
+            total += t;
+        }
+    }
+    report("flash", "read_lba", (long long)xfer_size << 9, bytes * reps, total, &s);
+
+    /* pipelined: a sample is the time between two delivered blocks */
+    rs.s = &s;
+    for (i = 0, total = 0; i < reps; i++) {
+        rs.t = t0 = now();
+        if ((r = rkflash_read(&f, FLASH_OFFSET, nsectors, read_block, &rs)))
+            fatal("read: %s\n", rkflash_strerror(r));
+        total += now() - t0;
+    }
+    report("flash", "read", (long long)xfer_size << 9, bytes * reps, total, &s);
+
+    for (i = 0, total = 0; i < reps; i++) {
+        for (off = 0; off < nsectors; off += bs) {
+            t0 = now();
+            if ((r = rkflash_erase(&f, FLASH_OFFSET + off, bs)) < 0)
+                fatal("erase: %s\n", rkflash_strerror(r));
+            t = now() - t0;
+            add(&s, t);
+            total += t;
+        }
+    }
+    report("flash", "erase", (long long)bs << 9, bytes * reps, total, &s);
+
+    rkflash_close(&f);
+    unlink(image);
+    free(buf);
+    free(s.t);
+}
+
+static void usage(void) {
+    fatal("rkbench v%d.%d\n"
+          "usage: rkbench [-n reps] [-m MB] [-t seconds] [-s nsectors] [-e opts]\n"
+          "               [-u rkunpack] [-d dir] [crc] [unpack] [flash]\n"
+          "\t-n reps       \trepetitions of the unpack and flash runs (default 5)\n"
+          "\t-m MB         \tsize of the synthetic images and flash area (default 64)\n"
+          "\t-t seconds    \tminimum time per CRC buffer size (default 0.5)\n"
+          "\t-s nsectors   \tsectors per flash transfer (default %d)\n"
+          "\t-e opts       \temulator options, e.g. latency=100,bandwidth=30\n"
+          "\t-u rkunpack   \trkunpack binary to run (default ./rkunpack)\n"
+          "\t-d dir        \tscratch directory (default $TMPDIR or /tmp)\n",
+          RKFLASHTOOL_VERSION_MAJOR, RKFLASHTOOL_VERSION_MINOR, RKFT_OFF_INCR);
+}
+
+int main(int argc, char *argv[]) {
+    const char *tmp = getenv("TMPDIR");
+    char scratch[PATH_MAX];
+    int ch, i, crc = 0, unpack = 0, flash = 0;
+
+    if (!tmp || !*tmp)
+        tmp = "/tmp";
+
+    while ((ch = getopt(argc, argv, "n:m:t:s:e:u:d:")) != -1) {
+        switch (ch) {
+        case 'n': reps = atoi(optarg); break;
+        case 'm': image_mb = strtoul(optarg, NULL, 0); break;
+        case 't': min_time = strtod(optarg, NULL); break;
+        case 's': xfer_size = strtoul(optarg, NULL, 0); break;
+        case 'e': emu_opts = optarg; break;
+        case 'u': rkunpack = optarg; break;
+        case 'd': tmp = optarg; break;
+        default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (reps < 1 || image_mb < 1 || image_mb > 2047 || xfer_size < 1 ||
+        xfer_size > 0xffff)
+        usage();
+
+    for (i = 0; i < argc; i++) {
+             if (!strcmp(argv[i], "crc"))    crc = 1;
+        else if (!strcmp(argv[i], "unpack")) unpack = 1;
+        else if (!strcmp(argv[i], "flash"))  flash = 1;
+        else usage();
+    }
+    if (!argc)
+        crc = unpack = flash = 1;
+
+    snprintf(scratch, sizeof(scratch), "%s/rkbench.XXXXXX", tmp);
+    if (!mkdtemp(scratch) || !realpath(scratch, dir))
+        fatal("%s: %s\n", scratch, strerror(errno));
+
+    info("rkbench v%d.%d, scratch directory %s\n",
+         RKFLASHTOOL_VERSION_MAJOR, RKFLASHTOOL_VERSION_MINOR, dir);
+
+    if (crc)    bench_crc();
+    if (unpack) bench_unpack();
+    if (flash)  bench_flash();
+
+    rmdir(dir);
+    return 0;
+}
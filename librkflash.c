@@ -0,0 +1,1280 @@
+/* librkflash - RockChip USB loader protocol library
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#include "rkcrc.h"
+#include "rkflashtool.h"
+#include "librkflash.h"
+
+/* statements, so they can be the body of an if */
+#define SETBE16(a, v) do { \
+                        ((uint8_t*)(a))[1] =  (v)      & 0xff; \
+                        ((uint8_t*)(a))[0] = ((v)>>8 ) & 0xff; \
+                      } while(0)
+
+#define SETBE32(a, v) do { \
+                        ((uint8_t*)(a))[3] =  (v)      & 0xff; \
+                        ((uint8_t*)(a))[2] = ((v)>>8 ) & 0xff; \
+                        ((uint8_t*)(a))[1] = ((v)>>16) & 0xff; \
+                        ((uint8_t*)(a))[0] = ((v)>>24) & 0xff; \
+                      } while(0)
+
+static const struct t_pid {
+    const uint16_t pid;
+    const char name[8];
+} pidtab[] = {
+    { 0x281a, "RK2818" },
+    { 0x290a, "RK2918" },
+    { 0x292a, "RK2928" },
+    { 0x292c, "RK3026" },
+    { 0x300a, "RK3066" },
+    { 0x300b, "RK3168" },
+    { 0x301a, "RK3036" },
+    { 0x310a, "RK3066B" },
+    { 0x310b, "RK3188" },
+    { 0x310c, "RK312X" }, // Both RK3126 and RK3128
+    { 0x310d, "RK3126" },
+    { 0x320a, "RK3288" },
+    { 0x320b, "RK322X" }, // Both RK3228 and RK3229
+    { 0x330a, "RK3368" },
+    { 0, "" },
+};
+
+static void msg(rkflash *f, int progress, const char *fmt, ...) {
+    va_list ap;
+
+    if (!f->message)
+        return;
+    va_start(ap, fmt);
+    f->message(f, progress, fmt, ap);
+    va_end(ap);
+}
+
+const char *rkflash_strerror(int err) {
+    switch (err) {
+    case RKFLASH_OK:        return "success";
+    case RKFLASH_ENODEV:    return "cannot open device";
+    case RKFLASH_EUSB:      return "USB transfer failed";
+    case RKFLASH_ECMD:      return "command failed on the device";
+    case RKFLASH_ENOMEM:    return "cannot allocate memory";
+    case RKFLASH_EPARAM:    return "bad parameter block";
+    case RKFLASH_ENOPART:   return "partition not found";
+    case RKFLASH_EINVAL:    return "invalid argument";
+    case RKFLASH_EABORT:    return "aborted";
+    }
+    return "unknown error";
+}
+
+/* Device selection
+ *
+ * RockChip devices are identified by their USB path, bus-port[.port...] as
+ * in /sys/bus/usb/devices, which stays the same across reconnects to the
+ * same port.
+ */
+
+static void device_path(libusb_device *dev, char *path, size_t len) {
+    uint8_t ports[7];
+    int i, n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+    snprintf(path, len, "%d", libusb_get_bus_number(dev));
+    for (i = 0; i < n; i++)
+        snprintf(path + strlen(path), len - strlen(path), "%c%d",
+                 i ? '.' : '-', ports[i]);
+}
+
+/* Calls fn for every RockChip device until it returns nonzero */
+static int each_device(libusb_context *usb,
+                       int (*fn)(void *arg, libusb_device *dev,
+                                 struct rkflash_device *d),
+                       void *arg) {
+    struct libusb_device_descriptor desc;
+    struct rkflash_device d;
+    const struct t_pid *ppid;
+    libusb_device **list;
+    ssize_t i, n;
+    int r = 0;
+
+    if ((n = libusb_get_device_list(usb, &list)) < 0)
+        return RKFLASH_EUSB;
+
+    for (i = 0; i < n && !r; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) ||
+            desc.idVendor != 0x2207)
+            continue;
+        for (ppid = pidtab; ppid->pid && ppid->pid != desc.idProduct; ppid++)
+            ;
+        if (!ppid->pid)
+            continue;
+
+        device_path(list[i], d.path, sizeof(d.path));
+        d.name = ppid->name;
+        r = fn(arg, list[i], &d);
+    }
+
+    libusb_free_device_list(list, 1);
+    return r;
+}
+
+struct list_arg {
+    struct rkflash_device *devs;
+    int max, n;
+};
+
+static int list_one(void *arg, libusb_device *dev, struct rkflash_device *d) {
+    struct list_arg *a = arg;
+
+    (void)dev;
+    if (a->n < a->max)
+        a->devs[a->n] = *d;
+    a->n++;
+    return 0;
+}
+
+/* Fills in up to max devices and returns how many are connected */
+int rkflash_list(struct rkflash_device *devs, int max) {
+    struct list_arg a = { devs, max, 0 };
+    libusb_context *usb;
+    int r;
+
+    if (libusb_init(&usb))
+        return RKFLASH_EUSB;
+    r = each_device(usb, list_one, &a);
+    libusb_exit(usb);
+    return r < 0 ? r : a.n;
+}
+
+static int open_one(void *arg, libusb_device *dev, struct rkflash_device *d) {
+    rkflash *f = arg;
+
+    if (*f->path && strcmp(f->path, d->path))
+        return 0;
+    if (libusb_open(dev, &f->h))
+        return RKFLASH_ENODEV;
+    strcpy(f->path, d->path);
+    f->name = d->name;
+    return 1;
+}
+
+/* libusb transport
+ *
+ * The slots of the pipelined reader are submitted as three asynchronous
+ * bulk transfers each, completed by libusb_handle_events_completed().
+ */
+
+static int usb_bulk(rkflash *f, unsigned char ep, uint8_t *data,
+                    unsigned int len, int *actual, unsigned int timeout) {
+    return libusb_bulk_transfer(f->h, ep, data, len, actual, timeout);
+}
+
+static int usb_control(rkflash *f, uint16_t index, uint8_t *data, uint16_t len) {
+    int r = libusb_control_transfer(f->h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0,
+                                    index, data, len, 0);
+    return r < 0 ? r : 0;
+}
+
+static void LIBUSB_CALL read_done(struct libusb_transfer *t) {
+    struct rkflash_slot *s = t->user_data;
+
+    if (t->status != LIBUSB_TRANSFER_COMPLETED)
+        s->failed = 1;
+    if (!--s->pending)
+        s->done = 1;
+}
+
+static int usb_submit(rkflash *f, struct rkflash_slot *s) {
+    int i;
+
+    for (i = 0; i < 3; i++)
+        if (!s->xfer[i] && !(s->xfer[i] = libusb_alloc_transfer(0)))
+            return LIBUSB_ERROR_NO_MEM;
+    libusb_fill_bulk_transfer(s->xfer[0], f->h, 2|LIBUSB_ENDPOINT_OUT,
+                              s->cmd, sizeof(s->cmd), read_done, s, 0);
+    libusb_fill_bulk_transfer(s->xfer[1], f->h, 1|LIBUSB_ENDPOINT_IN,
+                              s->data, s->nsectors << 9, read_done, s, 0);
+    libusb_fill_bulk_transfer(s->xfer[2], f->h, 1|LIBUSB_ENDPOINT_IN,
+                              s->res, sizeof(s->res), read_done, s, 0);
+
+    s->pending = 3;
+    for (i = 0; i < 3; i++) {
+        if (libusb_submit_transfer(s->xfer[i])) {
+            /* the ones already submitted still complete */
+            s->pending -= 3 - i;
+            s->done = !s->pending;
+            return LIBUSB_ERROR_IO;
+        }
+    }
+    return 0;
+}
+
+static int usb_wait(rkflash *f, struct rkflash_slot *s) {
+    while (!s->done)
+        if (libusb_handle_events_completed(f->usb, &s->done))
+            return LIBUSB_ERROR_IO;
+    return 0;
+}
+
+static void usb_cancel(rkflash *f, struct rkflash_slot *s) {
+    int i;
+
+    (void)f;
+    for (i = 0; i < 3; i++)
+        libusb_cancel_transfer(s->xfer[i]);
+}
+
+static void usb_clear_halt(rkflash *f) {
+    libusb_clear_halt(f->h, 1|LIBUSB_ENDPOINT_IN);
+    libusb_clear_halt(f->h, 2|LIBUSB_ENDPOINT_OUT);
+}
+
+static void usb_close(rkflash *f) {
+    struct rkflash_slot *s;
+    int i;
+
+    for (s = f->slots; s < f->slots + RKFT_QUEUE_DEPTH; s++)
+        for (i = 0; i < 3; i++)
+            libusb_free_transfer(s->xfer[i]);
+    if (f->h) {
+        libusb_release_interface(f->h, 0);
+        libusb_close(f->h);
+    }
+    if (f->usb)
+        libusb_exit(f->usb);
+    f->h = NULL;
+    f->usb = NULL;
+}
+
+static const struct rkflash_transport usb_transport = {
+    "usb", usb_bulk, usb_control, usb_submit, usb_wait, usb_cancel,
+    usb_clear_halt, usb_close
+};
+
+/* Sets up a context for the device at path on transport tr. The message
+ * and user fields may be set before.
+ */
+int rkflash_open_transport(rkflash *f, const struct rkflash_transport *tr,
+                           void *priv, const char *path, const char *name) {
+    void (*message)(rkflash *, int, const char *, va_list) = f->message;
+    void *user = f->user;
+
+    memset(f, 0, sizeof(*f));
+    f->message      = message;
+    f->user         = user;
+    f->tr           = tr;
+    f->tr_priv      = priv;
+    f->name         = name;
+    f->xfer_size    = RKFT_OFF_INCR;
+    f->erase_native = 1;
+    if (path)
+        snprintf(f->path, sizeof(f->path), "%s", path);
+    return 0;
+}
+
+/* Opens the USB device at path, or the first one found if path is NULL */
+int rkflash_open(rkflash *f, const char *path) {
+    struct libusb_device_descriptor desc;
+    int r;
+
+    rkflash_open_transport(f, &usb_transport, NULL, path, NULL);
+
+    if (libusb_init(&f->usb))
+        return RKFLASH_EUSB;
+
+    if ((r = each_device(f->usb, open_one, f)) <= 0) {
+        libusb_exit(f->usb);
+        f->usb = NULL;
+        return r ? r : RKFLASH_ENODEV;
+    }
+
+    if (libusb_kernel_driver_active(f->h, 0) == 1) {
+        msg(f, 0, "kernel driver active\n");
+        if (!libusb_detach_kernel_driver(f->h, 0))
+            msg(f, 0, "driver detached\n");
+    }
+
+    if (libusb_claim_interface(f->h, 0) < 0 ||
+        libusb_get_device_descriptor(libusb_get_device(f->h), &desc) != 0) {
+        rkflash_close(f);
+        return RKFLASH_ENODEV;
+    }
+
+    f->maskrom = desc.bcdUSB == 0x200;
+    return 0;
+}
+
+void rkflash_close(rkflash *f) {
+    struct rkflash_slot *s;
+
+    if (f->tr)
+        f->tr->close(f);
+    for (s = f->slots; s < f->slots + RKFT_QUEUE_DEPTH; s++)
+        free(s->data);
+    free(f->erase_buf);
+    free(f->bad);
+    free(f->check_buf);
+
+    memset(f->slots, 0, sizeof(f->slots));
+    f->slot_size = 0;
+    f->tr = NULL;
+    f->erase_buf = f->check_buf = NULL;
+    f->bad = NULL;
+}
+
+/* Raw protocol
+ *
+ * Every command is a 31 byte "USBC" block on endpoint 2, optionally
+ * followed by data in either direction, and answered with a 13 byte
+ * "USBS" status on endpoint 1 whose last byte is nonzero on failure.
+ */
+
+static void setup_cmd(uint8_t *cbw, uint32_t command, uint32_t offset,
+                      uint16_t nsectors) {
+    long int r = random();
+
+    memset(cbw, 0 , 31);
+    memcpy(cbw, "USBC", 4);
+
+    if (r)          SETBE32(cbw+4, r);
+    if (offset)     SETBE32(cbw+17, offset);
+    if (nsectors)   SETBE16(cbw+22, nsectors);
+    if (command)    SETBE32(cbw+12, command);
+}
+
+static int bulk(rkflash *f, unsigned char ep, uint8_t *data, unsigned int len,
+                unsigned int timeout) {
+    int n;
+
+    if (f->tr->bulk(f, ep, data, len, &n, timeout))
+        return RKFLASH_EUSB;
+    return 0;
+}
+
+int rkflash_send_cmd(rkflash *f, uint32_t command, uint32_t offset,
+                     uint16_t nsectors) {
+    setup_cmd(f->cmd, command, offset, nsectors);
+    return bulk(f, 2|LIBUSB_ENDPOINT_OUT, f->cmd, sizeof(f->cmd), 0);
+}
+
+int rkflash_send_exec(rkflash *f, uint32_t krnl_addr, uint32_t parm_addr) {
+    long int r = random();
+
+    memset(f->cmd, 0 , 31);
+    memcpy(f->cmd, "USBC", 4);
+
+    SETBE32(f->cmd+12, RKFT_CMD_EXECUTESDRAM);
+    if (r)
+        SETBE32(f->cmd+4, r);
+    if (krnl_addr)
+        SETBE32(f->cmd+17, krnl_addr);
+    if (parm_addr)
+        SETBE32(f->cmd+22, parm_addr);
+
+    return bulk(f, 2|LIBUSB_ENDPOINT_OUT, f->cmd, sizeof(f->cmd), 0);
+}
+
+int rkflash_send_reset(rkflash *f, uint8_t flag) {
+    long int r = random();
+
+    memset(f->cmd, 0 , 31);
+    memcpy(f->cmd, "USBC", 4);
+
+    SETBE32(f->cmd+4, r);
+    SETBE32(f->cmd+12, RKFT_CMD_RESETDEVICE);
+    f->cmd[16] = flag;
+
+    return bulk(f, 2|LIBUSB_ENDPOINT_OUT, f->cmd, sizeof(f->cmd), 0);
+}
+
+int rkflash_send_buf(rkflash *f, const uint8_t *data, unsigned int len) {
+    return bulk(f, 2|LIBUSB_ENDPOINT_OUT, (uint8_t *)data, len, 0);
+}
+
+int rkflash_recv_buf(rkflash *f, uint8_t *data, unsigned int len) {
+    return bulk(f, 1|LIBUSB_ENDPOINT_IN, data, len, 0);
+}
+
+int rkflash_recv_res(rkflash *f) {
+    if (bulk(f, 1|LIBUSB_ENDPOINT_IN, f->res, sizeof(f->res), 0))
+        return RKFLASH_EUSB;
+    if (memcmp(f->res, "USBS", 4) || f->res[12])
+        return RKFLASH_ECMD;
+    return 0;
+}
+
+/* A command with an optional data phase in either direction */
+static int command(rkflash *f, uint32_t command, uint32_t offset,
+                   uint16_t nsectors, uint8_t *in, const uint8_t *out,
+                   unsigned int len) {
+    int r;
+
+    if ((r = rkflash_send_cmd(f, command, offset, nsectors)) ||
+        (in  && (r = rkflash_recv_buf(f, in, len))) ||
+        (out && (r = rkflash_send_buf(f, out, len))))
+        return r;
+    return rkflash_recv_res(f);
+}
+
+/* Loader and chip */
+
+int rkflash_load(rkflash *f, int which, const uint8_t *data, size_t len) {
+    uint8_t buf[4096 + 2];
+    uint16_t crc16 = 0xffff;
+    size_t n;
+
+    /* 4096 byte chunks, the CRC16 goes after the data in the last one */
+    for (;;) {
+        n = len < 4096 ? len : 4096;
+        memcpy(buf, data, n);
+        crc16 = rkcrc16(crc16, buf, n);
+        if (n < 4096) {
+            buf[n++] = crc16 >> 8;
+            buf[n++] = crc16 & 0xff;
+        }
+        if (f->tr->control(f, which, buf, n))
+            return RKFLASH_EUSB;
+        if (n != 4096)
+            return 0;
+        data += n;
+        len  -= n;
+    }
+}
+
+int rkflash_ready(rkflash *f) {
+    int r = command(f, RKFT_CMD_TESTUNITREADY, 0, 0, NULL, NULL, 0);
+
+    usleep(20*1000);
+    return r == RKFLASH_ECMD ? 0 : r;
+}
+
+int rkflash_reset(rkflash *f, uint8_t flag) {
+    int r;
+
+    if ((r = rkflash_send_reset(f, flag)) ||
+        (r = rkflash_recv_res(f)) != RKFLASH_ECMD)
+        return r;
+    return 0;
+}
+
+int rkflash_chip_info(rkflash *f, uint8_t info[16]) {
+    return command(f, RKFT_CMD_READCHIPINFO, 0, 0, info, NULL, 16);
+}
+
+int rkflash_flash_id(rkflash *f, uint8_t id[5]) {
+    return command(f, RKFT_CMD_READFLASHID, 0, 0, id, NULL, 5);
+}
+
+int rkflash_flash_info(rkflash *f, nand_info *info) {
+    uint8_t buf[512];
+    int r;
+
+    if ((r = command(f, RKFT_CMD_READFLASHINFO, 0, 0, buf, NULL, sizeof(buf))))
+        return r;
+    memcpy(info, buf, sizeof(*info));
+    return 0;
+}
+
+/* Pipelined flash reader
+ *
+ * Every READLBA is a command/data/status triplet of bulk transfers. Instead
+ * of waiting for each round trip, up to RKFT_QUEUE_DEPTH triplets are
+ * submitted asynchronously. The device handles them in order, so the data
+ * and status transfers on endpoint 1 complete in submission order as well,
+ * and each slot is resubmitted for the next offset as soon as its block
+ * has been passed on.
+ */
+
+static int read_alloc(rkflash *f) {
+    struct rkflash_slot *s;
+
+    if (f->slot_size == f->xfer_size)
+        return 0;
+    for (s = f->slots; s < f->slots + RKFT_QUEUE_DEPTH; s++) {
+        free(s->data);
+        if (!(s->data = malloc(f->xfer_size << 9)))
+            return RKFLASH_ENOMEM;
+    }
+    f->slot_size = f->xfer_size;
+    return 0;
+}
+
+static int read_submit(rkflash *f, struct rkflash_slot *s,
+                       int *offset, int *size) {
+    s->offset   = *offset;
+    s->nsectors = *size < (int)f->xfer_size ? *size : (int)f->xfer_size;
+    setup_cmd(s->cmd, RKFT_CMD_READLBA, *offset, s->nsectors);
+    *offset += s->nsectors;
+    *size   -= s->nsectors;
+
+    s->done = s->failed = 0;
+    return f->tr->submit(f, s) ? RKFLASH_EUSB : 0;
+}
+
+int rkflash_read(rkflash *f, int offset, int nsectors,
+                 rkflash_block_cb cb, void *user) {
+    struct rkflash_slot *s;
+    unsigned int head = 0, queued = 0, i;
+    int r;
+
+    if ((r = read_alloc(f)))
+        return r;
+
+    for (i = 0; i < RKFT_QUEUE_DEPTH && nsectors > 0 && !r; i++, queued++)
+        r = read_submit(f, &f->slots[i], &offset, &nsectors);
+
+    while (queued && !r) {
+        s = &f->slots[head];
+        if (f->tr->wait(f, s)) {
+            r = RKFLASH_EUSB;
+            break;
+        }
+        if (s->failed || memcmp(s->res, "USBS", 4) || s->res[12]) {
+            msg(f, 0, "read failed at offset 0x%08x\n", s->offset);
+            r = s->failed ? RKFLASH_EUSB : RKFLASH_ECMD;
+            break;
+        }
+        if (cb(user, s->offset, s->data, s->nsectors)) {
+            r = RKFLASH_EABORT;
+            break;
+        }
+        head = (head + 1) % RKFT_QUEUE_DEPTH;
+        queued--;
+        if (nsectors > 0) {
+            queued++;
+            r = read_submit(f, s, &offset, &nsectors);
+        }
+    }
+
+    /* on errors, wait for what is still in flight before buffers get reused */
+    for (; queued; queued--, head = (head + 1) % RKFT_QUEUE_DEPTH) {
+        s = &f->slots[head];
+        if (!s->done)
+            f->tr->cancel(f, s);
+        if (f->tr->wait(f, s))
+            break;
+    }
+    return r;
+}
+
+struct read_lba_arg {
+    int offset;
+    uint8_t *data;
+};
+
+static int read_copy(void *user, int offset, uint8_t *data, int nsectors) {
+    struct read_lba_arg *a = user;
+
+    memcpy(a->data + ((offset - a->offset) << 9), data, nsectors << 9);
+    return 0;
+}
+
+int rkflash_read_lba(rkflash *f, int offset, int nsectors, uint8_t *data) {
+    struct read_lba_arg a = { offset, data };
+
+    return rkflash_read(f, offset, nsectors, read_copy, &a);
+}
+
+int rkflash_write_lba(rkflash *f, int offset, int nsectors, const uint8_t *data) {
+    int n, r;
+
+    while (nsectors > 0) {
+        n = nsectors < (int)f->xfer_size ? nsectors : (int)f->xfer_size;
+        if ((r = command(f, RKFT_CMD_WRITELBA, offset, n, NULL, data, n << 9)))
+            return r;
+        offset   += n;
+        nsectors -= n;
+        data     += n << 9;
+    }
+    return 0;
+}
+
+/* Transfer size probe
+ *
+ * Times READLBA at doubling sector counts from offset 0 and returns the
+ * fastest size the loader accepted. Refused or failing sizes end the probe.
+ * Nothing is written: a failed or partial WRITELBA there would destroy the
+ * parameter copies, and loaders limit both directions by the same buffer.
+ */
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int probe_cmd(rkflash *f, uint32_t command, uint8_t *data,
+                     unsigned int nsectors) {
+    unsigned char ep = command == RKFT_CMD_READLBA ? 1|LIBUSB_ENDPOINT_IN
+                                                   : 2|LIBUSB_ENDPOINT_OUT;
+    int n, len = nsectors << 9;
+
+    setup_cmd(f->cmd, command, 0, nsectors);
+    if (f->tr->bulk(f, 2|LIBUSB_ENDPOINT_OUT, f->cmd, sizeof(f->cmd), &n, RKFT_TIMEOUT) ||
+        f->tr->bulk(f, ep, data, len, &n, RKFT_TIMEOUT) || n != len ||
+        f->tr->bulk(f, 1|LIBUSB_ENDPOINT_IN, f->res, sizeof(f->res), &n, RKFT_TIMEOUT) ||
+        memcmp(f->res, "USBS", 4) || f->res[12]) {
+        f->tr->clear_halt(f);
+        return -1;
+    }
+    return 0;
+}
+
+/* Sets and returns the fastest transfer size */
+int rkflash_probe(rkflash *f) {
+    unsigned int n, i, count, best = RKFT_OFF_INCR;
+    double t0, rate, best_rate = 0;
+    uint8_t *data;
+
+    if (!(data = malloc(RKFT_PROBE_MAX << 9)))
+        return RKFLASH_ENOMEM;
+
+    for (n = RKFT_OFF_INCR; n <= RKFT_PROBE_MAX; n <<= 1) {
+        count = RKFT_PROBE_BYTES / (n << 9);
+        if (count < 2) count = 2;
+
+        t0 = now();
+        for (i = 0; i < count; i++)
+            if (probe_cmd(f, RKFT_CMD_READLBA, data, n))
+                break;
+
+        if (i < count) {
+            msg(f, 0, "%5u sectors: refused by loader\n", n);
+            break;
+        }
+
+        rate = (double)count * (n << 9) / (now() - t0) / 1e6;
+        msg(f, 0, "%5u sectors: read %.1f MB/s\n", n, rate);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = n;
+        }
+    }
+
+    free(data);
+    msg(f, 0, "using %u sectors per transfer\n", best);
+    f->xfer_size = best;
+    return best;
+}
+
+/* Flash erase
+ *
+ * The erase-block aligned part of a range is erased on the device with
+ * ERASESECTORS, in as few commands as the 16-bit sector count allows.
+ * Unaligned edges, and everything after the loader refused ERASESECTORS
+ * once, are filled with 0xff through WRITELBA instead.
+ */
+
+static int get_erase_block(rkflash *f) {
+    nand_info nand;
+    int r;
+
+    if (!f->erase_block) {
+        if ((r = rkflash_flash_info(f, &nand)))
+            return r;
+
+        f->erase_block = nand.block_size;
+        if (!f->erase_block) {
+            msg(f, 0, "unknown erase block size, erasing with 0xff writes\n");
+            f->erase_native = 0;
+            f->erase_block  = 1;
+        }
+    }
+    return f->erase_block;
+}
+
+static int erase_fill(rkflash *f, int offset, int size) {
+    int r;
+
+    if (f->erase_buf_size != f->xfer_size) {
+        free(f->erase_buf);
+        if (!(f->erase_buf = malloc(f->xfer_size << 9)))
+            return RKFLASH_ENOMEM;
+        memset(f->erase_buf, 0xff, f->xfer_size << 9);
+        f->erase_buf_size = f->xfer_size;
+    }
+
+    while (size > 0) {
+        int nsectors = size < (int)f->xfer_size ? size : (int)f->xfer_size;
+
+        msg(f, 1, "erasing flash memory at offset 0x%08x", offset);
+
+        if ((r = rkflash_write_lba(f, offset, nsectors, f->erase_buf)))
+            return r;
+
+        offset += nsectors;
+        size   -= nsectors;
+    }
+    return 0;
+}
+
+/* Returns the number of sectors that had to be written with 0xff. */
+int rkflash_erase(rkflash *f, int offset, int size) {
+    int bs, head, body, chunk, filled = 0, r;
+
+    if ((bs = get_erase_block(f)) < 0)
+        return bs;
+
+    if (!f->erase_native)
+        return (r = erase_fill(f, offset, size)) ? r : size;
+
+    head = (bs - offset % bs) % bs;
+    if (head > size) head = size;
+    body = (size - head) / bs * bs;
+
+    if ((r = erase_fill(f, offset, head)))
+        return r;
+    filled += head;
+    offset += head;
+    size   -= head;
+
+    while (body > 0) {
+        chunk = 0xffff / bs * bs;
+        if (chunk > body) chunk = body;
+
+        msg(f, 1, "erasing flash memory at offset 0x%08x", offset);
+
+        if (f->erase_native) {
+            r = command(f, RKFT_CMD_ERASESECTORS, offset, chunk, NULL, NULL, 0);
+            if (r == RKFLASH_ECMD) {
+                msg(f, 1, "loader refused ERASESECTORS, erasing with 0xff writes\n");
+                f->erase_native = 0;
+            } else if (r) {
+                return r;
+            }
+        }
+        if (!f->erase_native) {
+            if ((r = erase_fill(f, offset, chunk)))
+                return r;
+            filled += chunk;
+        }
+
+        offset += chunk;
+        size   -= chunk;
+        body   -= chunk;
+    }
+
+    if ((r = erase_fill(f, offset, size)))
+        return r;
+    return filled + size;
+}
+
+/* Sparse and delta writes
+ *
+ * Data is scanned in RKFT_OFF_INCR sector pieces. Runs of pieces that are
+ * all 0xff, the erased state of the flash, are collected across calls and
+ * either erased with rkflash_erase() or skipped when the target is known
+ * to be erased. Only the remaining data goes through WRITELBA. Runs added
+ * with rkflash_fill() are collected the same way, whatever the sparse
+ * setting.
+ *
+ * Given the old device contents, pieces that already match are left out.
+ * Adjacent changed pieces go out in one WRITELBA, including 0xff ones
+ * when skipping: a piece that changed was not erased.
+ */
+
+/* memcmp() against itself shifted by one byte is vectorized by libc */
+static int is_filled(const uint8_t *p, size_t len, uint8_t value) {
+    return len && p[0] == value && !memcmp(p, p + 1, len - 1);
+}
+
+int rkflash_flush(rkflash *f) {
+    int filled = 0;
+
+    if (!f->ff_size)
+        return 0;
+    if (f->sparse != RKFLASH_SPARSE_SKIP &&
+        (filled = rkflash_erase(f, f->ff_offset, f->ff_size)) < 0)
+        return filled;
+    f->sparse_saved += (long long)(f->ff_size - filled) << 9;
+    f->ff_size = 0;
+    return 0;
+}
+
+int rkflash_fill(rkflash *f, int offset, int nsectors) {
+    int r;
+
+    if (f->ff_size && f->ff_offset + f->ff_size != offset &&
+        (r = rkflash_flush(f)))
+        return r;
+    if (!f->ff_size)
+        f->ff_offset = offset;
+    f->ff_size += nsectors;
+    return 0;
+}
+
+/* Writes the run of pieces that ends at offset/data, if any */
+static int write_run(rkflash *f, int offset, const uint8_t *data, int *run) {
+    int r = 0;
+
+    if (*run) {
+        if (!(r = rkflash_flush(f)))
+            r = rkflash_write_lba(f, offset - *run, *run, data - (*run << 9));
+        *run = 0;
+    }
+    return r;
+}
+
+/* Writes data, leaving out pieces equal to old (if given) and collecting
+ * 0xff pieces (in sparse mode).
+ */
+int rkflash_write(rkflash *f, int offset, int nsectors, const uint8_t *data,
+                  const uint8_t *old) {
+    int i, n, run = 0, r;
+
+    if (!f->sparse && !old)
+        return rkflash_write_lba(f, offset, nsectors, data);
+
+    if (old)
+        f->delta_total += (long long)nsectors << 9;
+
+    for (i = 0; i < nsectors; i += n) {
+        const uint8_t *p = data + (i << 9);
+
+        n = nsectors - i < RKFT_OFF_INCR ? nsectors - i : RKFT_OFF_INCR;
+
+        if (old && !memcmp(p, old + (i << 9), n << 9)) {
+            if ((r = write_run(f, offset + i, p, &run)))
+                return r;
+            continue;
+        }
+        if (old)
+            f->delta_changed += n << 9;
+        /* with old the target is known not to be erased here, so in skip
+         * mode a changed 0xff piece is written like any other */
+        if (f->sparse && !(old && f->sparse == RKFLASH_SPARSE_SKIP) &&
+            is_filled(p, n << 9, 0xff)) {
+            if ((r = write_run(f, offset + i, p, &run)) ||
+                (r = rkflash_fill(f, offset + i, n)))
+                return r;
+            continue;
+        }
+        run += n;
+    }
+    return write_run(f, offset + nsectors, data + (nsectors << 9), &run);
+}
+
+/* Read-back verification
+ *
+ * rkflash_check() compares what was written with what was read back and
+ * collects the mismatching sector ranges; the data must stay valid until
+ * rkflash_fixup(), which rewrites those ranges up to verify_retries times
+ * and reports the ones that still differ.
+ */
+
+static int check_alloc(rkflash *f, int nsectors) {
+    uint8_t *p;
+
+    if ((unsigned int)nsectors > f->check_size) {
+        if (!(p = realloc(f->check_buf, nsectors << 9)))
+            return RKFLASH_ENOMEM;
+        f->check_buf  = p;
+        f->check_size = nsectors;
+    }
+    return 0;
+}
+
+static int find_bad(rkflash *f, int offset, int nsectors, const uint8_t *src,
+                    const uint8_t *dev) {
+    struct rkflash_range *p;
+    int i, start = -1, same;
+
+    if (!memcmp(src, dev, nsectors << 9))
+        return 0;
+
+    for (i = 0; i <= nsectors; i++) {
+        same = i == nsectors || !memcmp(src + (i << 9), dev + (i << 9), 512);
+        if (!same && start < 0) {
+            start = i;
+        } else if (same && start >= 0) {
+            if (f->nbad == f->maxbad) {
+                int max = f->maxbad ? 2 * f->maxbad : 16;
+
+                if (!(p = realloc(f->bad, max * sizeof(*p))))
+                    return RKFLASH_ENOMEM;
+                f->bad    = p;
+                f->maxbad = max;
+            }
+            f->bad[f->nbad].offset   = offset + start;
+            f->bad[f->nbad].nsectors = i - start;
+            f->bad[f->nbad].data     = src + (start << 9);
+            f->nbad++;
+            start = -1;
+        }
+    }
+    return 0;
+}
+
+/* Collects the runs of sectors where data and dev differ */
+int rkflash_check(rkflash *f, int offset, int nsectors, const uint8_t *data,
+                  const uint8_t *dev) {
+    f->verify_total += (long long)nsectors << 9;
+    return find_bad(f, offset, nsectors, data, dev);
+}
+
+/* Rewrites and rechecks the collected ranges, then reports what is left.
+ * Returns the number of sectors that still differ.
+ */
+int rkflash_fixup(rkflash *f) {
+    struct rkflash_range b;
+    int i, n, attempt, left = 0, r = 0;
+
+    for (attempt = 0; attempt < f->verify_retries && f->nbad && !r; attempt++) {
+        n = f->nbad;
+        for (i = 0; i < n && !r; i++) {
+            msg(f, 1, "rewriting flash memory at offset 0x%08x", f->bad[i].offset);
+            r = rkflash_write_lba(f, f->bad[i].offset, f->bad[i].nsectors,
+                                  f->bad[i].data);
+        }
+        for (i = 0; i < n && !r; i++) {
+            b = f->bad[i];
+            if (!(r = check_alloc(f, b.nsectors)) &&
+                !(r = rkflash_read_lba(f, b.offset, b.nsectors, f->check_buf)))
+                r = find_bad(f, b.offset, b.nsectors, b.data, f->check_buf);
+        }
+        memmove(f->bad, f->bad + n, (f->nbad - n) * sizeof(*f->bad));
+        f->nbad -= n;
+    }
+
+    /* ranges are collected per check, report the runs they make up */
+    for (i = 0; i < f->nbad; i = n) {
+        b = f->bad[i];
+        for (n = i + 1; n < f->nbad &&
+                        f->bad[n].offset == b.offset + b.nsectors; n++)
+            b.nsectors += f->bad[n].nsectors;
+        msg(f, 1, "verify: sectors 0x%08x-0x%08x differ\n", b.offset,
+            b.offset + b.nsectors - 1);
+        left += b.nsectors;
+    }
+    f->verify_bad += (long long)left << 9;
+    f->nbad = 0;
+    return r ? r : left;
+}
+
+/* Reads back, checks and fixes up one range */
+int rkflash_verify(rkflash *f, int offset, int nsectors, const uint8_t *data) {
+    int r;
+
+    if ((r = check_alloc(f, nsectors)) ||
+        (r = rkflash_read_lba(f, offset, nsectors, f->check_buf)) ||
+        (r = rkflash_check(f, offset, nsectors, data, f->check_buf)))
+        return r;
+    return rkflash_fixup(f);
+}
+
+/* Parameters
+ *
+ * The parameter block is "PARM", a 32-bit length, the text and its
+ * rkcrc32, stored at the start of the flash.
+ */
+
+static int params_block(rkflash *f, uint8_t *buf, int *len) {
+    int r;
+
+    if ((r = command(f, RKFT_CMD_READLBA, 0, RKFT_OFF_INCR, buf, NULL,
+                     RKFT_BLOCKSIZE)))
+        return r;
+
+    /* Check parameter length */
+    *len = *(uint32_t *)(buf + 4);
+    if (*len < 0 || *len > MAX_PARAM_LENGTH || *len > RKFT_BLOCKSIZE - 12) {
+        msg(f, 0, "Bad parameter length!\n");
+        return RKFLASH_EPARAM;
+    }
+    return 0;
+}
+
+/* Reads the parameter block into buf, RKFT_BLOCKSIZE bytes. The text
+ * starts at buf + 8 and is len bytes long.
+ */
+int rkflash_read_params(rkflash *f, uint8_t *buf, int *len) {
+    uint32_t crc_buf, crc;
+    int r;
+
+    if ((r = params_block(f, buf, len)))
+        return r;
+
+    /* Check CRC */
+    crc_buf = *(uint32_t *)(buf + 8 + *len);
+    crc = rkcrc32(0, buf + 8, *len);
+    if (crc_buf != crc) {
+        msg(f, 0, "bad CRC! (%#x, should be %#x)\n", crc_buf, crc);
+        return RKFLASH_EPARAM;
+    }
+    return 0;
+}
+
+/* Writes the parameter block. With verify, returns the number of sectors
+ * that still differ after rkflash_fixup().
+ */
+int rkflash_write_params(rkflash *f, const uint8_t *data, int len, int verify) {
+    uint8_t *buf;
+    uint32_t crc;
+    int offset, r = 0;
+
+    if (len < 0 || len > RKFT_BLOCKSIZE - 12)
+        return RKFLASH_EINVAL;
+    if (!(buf = calloc(1, RKFT_BLOCKSIZE)))
+        return RKFLASH_ENOMEM;
+
+    /* Header, length, content and CRC */
+    memcpy(buf, "PARM", 4);
+    *(uint32_t *)(buf + 4) = len;
+    memcpy(buf + 8, data, len);
+    crc = rkcrc32(0, buf + 8, len);
+    PUT32LE(buf + 8 + len, crc);
+
+    /*
+     * The parameter file is written at 8 different offsets:
+     * 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00
+     */
+
+    for (offset = 0; offset < 0x2000 && !r; offset += 0x400) {
+        msg(f, 1, "writing flash memory at offset 0x%08x", offset);
+        r = command(f, RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR, NULL, buf,
+                    RKFT_BLOCKSIZE);
+    }
+
+    if (verify && !r && !(r = check_alloc(f, RKFT_OFF_INCR))) {
+        for (offset = 0; offset < 0x2000 && !r; offset += 0x400) {
+            msg(f, 1, "verifying flash memory at offset 0x%08x", offset);
+            if (!(r = rkflash_read_lba(f, offset, RKFT_OFF_INCR, f->check_buf)))
+                r = rkflash_check(f, offset, RKFT_OFF_INCR, buf, f->check_buf);
+        }
+        if (!r)
+            r = rkflash_fixup(f);
+    }
+
+    free(buf);
+    return r;
+}
+
+/* Parses the mtdparts of params, the text of a parameter file, into at
+ * most max partitions and returns how many there are, which may be more
+ * than max. It is the Linux syntax,
+ *
+ * mtdparts=<mtd-id>:<size>[@<offset>][(<name>)][ro][lk][,...][;<mtd-id>:...]
+ *
+ * with sizes and offsets in sectors. A partition without an offset
+ * follows the one before it, and one of size - (up to the end of the
+ * flash) gets a size of -1.
+ */
+int rkflash_parse_mtdparts(const char *params, struct rkflash_partition *parts,
+                           int max) {
+    struct rkflash_partition part;
+    const char *p, *close;
+    char *end;
+    int n = 0, next = 0;
+
+    if (!(p = strstr(params, "mtdparts=")))
+        return RKFLASH_ENOPART;
+    p += 9;
+
+    do {
+        /* mtd-id */
+        p += strcspn(p, ": \t\r\n");
+        if (*p++ != ':')
+            return RKFLASH_EPARAM;
+
+        do {
+            memset(&part, 0, sizeof(part));
+            if (*p == '-') {
+                part.size = -1;
+                p++;
+            } else {
+                part.size = strtoul(p, &end, 0);
+                if (end == p)
+                    return RKFLASH_EPARAM;
+                p = end;
+            }
+            if (*p == '@') {
+                part.offset = strtoul(p + 1, &end, 0);
+                if (end == p + 1)
+                    return RKFLASH_EPARAM;
+                p = end;
+            } else {
+                part.offset = next;
+            }
+            if (*p == '(') {
+                if (!(close = strchr(p, ')')) ||
+                    close - p - 1 >= (int)sizeof(part.name))
+                    return RKFLASH_EPARAM;
+                memcpy(part.name, p + 1, close - p - 1);
+                p = close + 1;
+            }
+            while (!strncmp(p, "ro", 2) || !strncmp(p, "lk", 2))
+                p += 2;
+
+            if (n < max)
+                parts[n] = part;
+            n++;
+            next = part.offset + part.size;
+        } while (*p == ',' && *++p);
+    } while (*p == ';' && *++p);
+
+    if (*p && !strchr(" \t\r\n", *p))
+        return RKFLASH_EPARAM;
+    return n;
+}
+
+/* Reads the parameter block and parses its mtdparts, see above. The CRC
+ * stored in the block identifies the table, e.g. for caching it.
+ */
+int rkflash_read_partitions(rkflash *f, struct rkflash_partition *parts, int max,
+                            uint32_t *crc) {
+    uint8_t buf[RKFT_BLOCKSIZE];
+    int len, r;
+
+    if ((r = params_block(f, buf, &len)))
+        return r;
+    if (crc)
+        *crc = *(uint32_t *)(buf + 8 + len);
+    buf[8 + len] = '\0';
+
+    if ((r = rkflash_parse_mtdparts((char *)buf + 8, parts, max)) == RKFLASH_ENOPART)
+        msg(f, 0, "Error: 'mtdparts' not found in command line.\n");
+    else if (r < 0)
+        msg(f, 0, "Error: Bad syntax in mtdparts.\n");
+    return r;
+}
+
+/* Looks up a partition in the mtdparts of the parameter block */
+int rkflash_find_partition(rkflash *f, const char *name, int *offset, int *size) {
+    uint8_t buf[RKFT_BLOCKSIZE];
+    int len, r;
+
+    if ((r = params_block(f, buf, &len)))
+        return r;
+    buf[8 + len] = '\0';
+
+    return rkflash_parse_partition(f, (char *)buf + 8, name, offset, size);
+}
+
+/* Looks up a partition in the mtdparts of params, the text of a parameter
+ * file, without reading it from the device again.
+ */
+int rkflash_parse_partition(rkflash *f, const char *params, const char *name,
+                            int *offset, int *size) {
+    struct rkflash_partition parts[RKFLASH_MAX_PARTITIONS];
+    nand_info nand;
+    int i, n, r;
+
+    if ((n = rkflash_parse_mtdparts(params, parts, RKFLASH_MAX_PARTITIONS)) < 0) {
+        msg(f, 0, n == RKFLASH_ENOPART ? "Error: 'mtdparts' not found in command line.\n"
+                                       : "Error: Bad syntax in mtdparts.\n");
+        return RKFLASH_ENOPART;
+    }
+
+    for (i = 0; i < n && i < RKFLASH_MAX_PARTITIONS && strcmp(parts[i].name, name); i++)
+        ;
+    if (i == n || i == RKFLASH_MAX_PARTITIONS) {
+        msg(f, 0, "Error: Partition '%s' not found.\n", name);
+        return RKFLASH_ENOPART;
+    }
+
+    *offset = parts[i].offset;
+    msg(f, 0, "found offset: %#010x\n", *offset);
+
+    if (parts[i].size < 0) {
+        /* Read size from NAND info */
+        if ((r = rkflash_flash_info(f, &nand)))
+            return r;
+        *size = nand.flash_size - *offset;
+        msg(f, 0, "partition extends up to the end of NAND (size: 0x%08x).\n", *size);
+        return 0;
+    }
+
+    *size = parts[i].size;
+    msg(f, 0, "found size: %#010x\n", *size);
+    return 0;
+}
+
+/* SDRAM and IDB */
+
+int rkflash_read_sdram(rkflash *f, uint32_t addr, uint8_t *data, int len) {
+    int n, r;
+
+    for (; len > 0; addr += n, data += n, len -= n) {
+        n = len > RKFT_BLOCKSIZE ? RKFT_BLOCKSIZE : len;
+        if ((r = command(f, RKFT_CMD_READSDRAM, addr - SDRAM_BASE_ADDRESS, n,
+                         data, NULL, n)))
+            return r;
+    }
+    return 0;
+}
+
+int rkflash_write_sdram(rkflash *f, uint32_t addr, const uint8_t *data, int len) {
+    int n, r;
+
+    for (; len > 0; addr += n, data += n, len -= n) {
+        n = len > RKFT_BLOCKSIZE ? RKFT_BLOCKSIZE : len;
+        if ((r = command(f, RKFT_CMD_WRITESDRAM, addr - SDRAM_BASE_ADDRESS, n,
+                         NULL, data, n)))
+            return r;
+    }
+    return 0;
+}
+
+int rkflash_exec(rkflash *f, uint32_t krnl_addr, uint32_t parm_addr) {
+    int r;
+
+    if ((r = rkflash_send_exec(f, krnl_addr - SDRAM_BASE_ADDRESS,
+                                  parm_addr - SDRAM_BASE_ADDRESS)) ||
+        (r = rkflash_recv_res(f)) != RKFLASH_ECMD)
+        return r;
+    return 0;
+}
+
+/* Reads nsectors IDB sectors of RKFT_IDB_BLOCKSIZE bytes each */
+int rkflash_read_idb(rkflash *f, int offset, int nsectors, uint8_t *data) {
+    int n, r;
+
+    for (; nsectors > 0; offset += n, nsectors -= n) {
+        n = nsectors > RKFT_IDB_INCR ? RKFT_IDB_INCR : nsectors;
+        if ((r = command(f, RKFT_CMD_READSECTOR, offset, n, data, NULL,
+                         RKFT_IDB_BLOCKSIZE * n)))
+            return r;
+        data += RKFT_IDB_BLOCKSIZE * n;
+    }
+    return 0;
+}
+
+/* Writes one IDB sector of up to RKFT_IDB_DATASIZE bytes, padded with 0xff */
+int rkflash_write_idb(rkflash *f, int offset, const uint8_t *data, int len) {
+    uint8_t buf[RKFT_IDB_BLOCKSIZE];
+
+    if (len < 0 || len > RKFT_IDB_DATASIZE)
+        return RKFLASH_EINVAL;
+    memset(buf, 0xff, sizeof(buf));
+    memcpy(buf, data, len);
+    return command(f, RKFT_CMD_WRITESECTOR, offset, 1, NULL, buf, sizeof(buf));
+}
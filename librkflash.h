@@ -0,0 +1,278 @@
+/* librkflash - RockChip USB loader protocol library
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* All state of a connection lives in a struct rkflash, so one process can
+ * drive any number of devices, each from its own thread. Functions return
+ * 0 (or a count) on success and a negative RKFLASH_E* code on failure;
+ * nothing here prints or exits. Messages and progress go through the
+ * optional message callback.
+ */
+
+#ifndef LIBRKFLASH_H
+#define LIBRKFLASH_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <libusb.h>
+
+#define RKFT_BLOCKSIZE      0x4000      /* must be multiple of 512 */
+#define RKFT_IDB_DATASIZE   0x200
+#define RKFT_IDB_BLOCKSIZE  0x210
+#define RKFT_IDB_INCR       0x20
+#define RKFT_MEM_INCR       0x80
+#define RKFT_OFF_INCR       (RKFT_BLOCKSIZE>>9)
+#define MAX_PARAM_LENGTH    (128*512-12) /* cf. MAX_LOADER_PARAM in rkloader */
+#define RKFT_QUEUE_DEPTH    8           /* READLBA requests kept in flight */
+#define RKFT_PROBE_MAX      0x2000      /* largest transfer size probed, in sectors */
+#define RKFT_PROBE_BYTES    0x400000    /* bytes moved per probed transfer size */
+#define RKFT_TIMEOUT        5000        /* ms, for transfers that may be refused */
+#define SDRAM_BASE_ADDRESS  0x60000000
+
+#define RKFT_CMD_TESTUNITREADY      0x80000600
+#define RKFT_CMD_READFLASHID        0x80000601
+#define RKFT_CMD_READFLASHINFO      0x8000061a
+#define RKFT_CMD_READCHIPINFO       0x8000061b
+#define RKFT_CMD_READEFUSE          0x80000620
+
+#define RKFT_CMD_SETDEVICEINFO      0x00000602
+#define RKFT_CMD_ERASESYSTEMDISK    0x00000616
+#define RKFT_CMD_SETRESETFLASG      0x0000061e
+#define RKFT_CMD_RESETDEVICE        0x000006ff
+
+#define RKFT_CMD_TESTBADBLOCK       0x80000a03
+#define RKFT_CMD_READSECTOR         0x80000a04
+#define RKFT_CMD_READLBA            0x80000a14
+#define RKFT_CMD_READSDRAM          0x80000a17
+#define RKFT_CMD_UNKNOWN1           0x80000a21
+
+#define RKFT_CMD_WRITESECTOR        0x00000a05
+#define RKFT_CMD_ERASESECTORS       0x00000a06
+#define RKFT_CMD_UNKNOWN2           0x00000a0b
+#define RKFT_CMD_WRITELBA           0x00000a15
+#define RKFT_CMD_WRITESDRAM         0x00000a18
+#define RKFT_CMD_EXECUTESDRAM       0x00000a19
+#define RKFT_CMD_WRITEEFUSE         0x00000a1f
+#define RKFT_CMD_UNKNOWN3           0x00000a22
+
+#define RKFT_CMD_WRITESPARE         0x80001007
+#define RKFT_CMD_READSPARE          0x80001008
+
+#define RKFT_CMD_LOWERFORMAT        0x0000001c
+#define RKFT_CMD_WRITENKB           0x00000030
+
+#define RKFLASH_LOAD_DDR    1137        /* DDR init, in MASK ROM mode */
+#define RKFLASH_LOAD_USB    1138        /* USB loader, in MASK ROM mode */
+
+enum {
+    RKFLASH_OK      =  0,
+    RKFLASH_ENODEV  = -1,   /* no such device, or it cannot be opened */
+    RKFLASH_EUSB    = -2,   /* USB transfer failed */
+    RKFLASH_ECMD    = -3,   /* loader reported failure of a command */
+    RKFLASH_ENOMEM  = -4,
+    RKFLASH_EPARAM  = -5,   /* bad parameter block */
+    RKFLASH_ENOPART = -6,   /* partition not found in mtdparts */
+    RKFLASH_EINVAL  = -7,   /* bad argument */
+    RKFLASH_EABORT  = -8,   /* stopped by a callback */
+};
+
+enum rkflash_sparse {
+    RKFLASH_SPARSE_OFF,     /* write 0xff data like any other */
+    RKFLASH_SPARSE_ERASE,   /* erase runs of 0xff instead of writing them */
+    RKFLASH_SPARSE_SKIP,    /* leave runs of 0xff alone, target is erased */
+};
+
+typedef struct {
+    uint32_t flash_size;
+    uint16_t block_size;
+    uint8_t page_size;
+    uint8_t ecc_bits;
+    uint8_t access_time;
+    uint8_t manufacturer_id;
+    uint8_t chip_select;
+} nand_info;
+
+struct rkflash_device {
+    char path[32];          /* bus-port[.port...] as in /sys/bus/usb/devices */
+    const char *name;       /* SoC name */
+};
+
+struct rkflash_range {
+    int offset, nsectors;
+    const uint8_t *data;
+};
+
+typedef struct rkflash rkflash;
+
+/* Receives each block of rkflash_read() in offset order; the data stays
+ * valid until it returns. A nonzero return stops the read.
+ */
+typedef int (*rkflash_block_cb)(void *user, int offset, uint8_t *data,
+                                int nsectors);
+
+/* One READLBA of the pipelined reader; the transport sets done (and
+ * failed) once the command, data and status phases have completed.
+ */
+struct rkflash_slot {
+    struct libusb_transfer *xfer[3];    /* command, data, status */
+    uint8_t cmd[31], res[13];
+    uint8_t *data;
+    int offset, nsectors;
+    int pending, done, failed;
+    double due;                         /* emulator completion time */
+};
+
+/* Transport
+ *
+ * Everything that goes over the wire passes through these. bulk() and
+ * control() return 0 or a negative libusb error; bulk() stores the bytes
+ * moved in *actual. submit() starts the three phases of a slot without
+ * waiting, wait() blocks until the slot is done and cancel() gives up on
+ * it. clear_halt() recovers both endpoints after a refused command.
+ */
+struct rkflash_transport {
+    const char *name;
+    int  (*bulk)(rkflash *f, unsigned char ep, uint8_t *data, unsigned int len,
+                 int *actual, unsigned int timeout);
+    int  (*control)(rkflash *f, uint16_t index, uint8_t *data, uint16_t len);
+    int  (*submit)(rkflash *f, struct rkflash_slot *s);
+    int  (*wait)(rkflash *f, struct rkflash_slot *s);
+    void (*cancel)(rkflash *f, struct rkflash_slot *s);
+    void (*clear_halt)(rkflash *f);
+    void (*close)(rkflash *f);
+};
+
+struct rkflash {
+    /* settings, may be changed any time after rkflash_open() */
+    unsigned int xfer_size;             /* sectors per READLBA/WRITELBA */
+    enum rkflash_sparse sparse;
+    int verify_retries;                 /* rewrites of differing ranges */
+
+    /* Called for messages; progress lines have no trailing newline and are
+     * overwritten by the next message.
+     */
+    void (*message)(rkflash *f, int progress, const char *fmt, va_list ap);
+    void *user;
+
+    /* statistics, in bytes */
+    long long sparse_saved;             /* not sent over USB */
+    long long delta_total, delta_changed;
+    long long verify_total, verify_bad;
+
+    /* the device */
+    char path[32];
+    const char *name;
+    int maskrom;
+
+    /* private */
+    const struct rkflash_transport *tr;
+    void *tr_priv;                      /* transport state */
+    libusb_context *usb;
+    libusb_device_handle *h;
+    uint8_t cmd[31], res[13];
+    struct rkflash_slot slots[RKFT_QUEUE_DEPTH];
+    unsigned int slot_size;
+    unsigned int erase_block;           /* sectors, 0 if not yet known */
+    int erase_native;
+    uint8_t *erase_buf;
+    unsigned int erase_buf_size;
+    int ff_offset, ff_size;             /* pending run of 0xff sectors */
+    struct rkflash_range *bad;
+    int nbad, maxbad;
+    uint8_t *check_buf;
+    unsigned int check_size;
+};
+
+/* Devices */
+int  rkflash_list(struct rkflash_device *devs, int max);
+int  rkflash_open(rkflash *f, const char *path);
+int  rkflash_open_transport(rkflash *f, const struct rkflash_transport *tr,
+                            void *priv, const char *path, const char *name);
+int  rkflash_open_emulator(rkflash *f, const char *spec, const char *path);
+void rkflash_close(rkflash *f);
+const char *rkflash_strerror(int err);
+
+/* Raw protocol */
+int rkflash_send_cmd(rkflash *f, uint32_t command, uint32_t offset,
+                     uint16_t nsectors);
+int rkflash_send_exec(rkflash *f, uint32_t krnl_addr, uint32_t parm_addr);
+int rkflash_send_reset(rkflash *f, uint8_t flag);
+int rkflash_send_buf(rkflash *f, const uint8_t *data, unsigned int len);
+int rkflash_recv_buf(rkflash *f, uint8_t *data, unsigned int len);
+int rkflash_recv_res(rkflash *f);
+
+/* Loader and chip */
+int rkflash_load(rkflash *f, int which, const uint8_t *data, size_t len);
+int rkflash_ready(rkflash *f);
+int rkflash_reset(rkflash *f, uint8_t flag);
+int rkflash_chip_info(rkflash *f, uint8_t info[16]);
+int rkflash_flash_id(rkflash *f, uint8_t id[5]);
+int rkflash_flash_info(rkflash *f, nand_info *info);
+int rkflash_probe(rkflash *f);
+
+/* Flash */
+int rkflash_read(rkflash *f, int offset, int nsectors,
+                 rkflash_block_cb cb, void *user);
+int rkflash_read_lba(rkflash *f, int offset, int nsectors, uint8_t *data);
+int rkflash_write_lba(rkflash *f, int offset, int nsectors, const uint8_t *data);
+int rkflash_write(rkflash *f, int offset, int nsectors, const uint8_t *data,
+                  const uint8_t *old);
+int rkflash_fill(rkflash *f, int offset, int nsectors);
+int rkflash_flush(rkflash *f);
+int rkflash_erase(rkflash *f, int offset, int nsectors);
+int rkflash_check(rkflash *f, int offset, int nsectors, const uint8_t *data,
+                  const uint8_t *dev);
+int rkflash_verify(rkflash *f, int offset, int nsectors, const uint8_t *data);
+int rkflash_fixup(rkflash *f);
+
+/* Parameters */
+#define RKFLASH_MAX_PARTITIONS  64
+
+struct rkflash_partition {
+    char name[64];
+    int offset;             /* sectors */
+    int size;               /* sectors, -1 up to the end of the flash */
+};
+
+int rkflash_read_params(rkflash *f, uint8_t *buf, int *len);
+int rkflash_write_params(rkflash *f, const uint8_t *data, int len, int verify);
+int rkflash_find_partition(rkflash *f, const char *name,
+                           int *offset, int *size);
+int rkflash_parse_partition(rkflash *f, const char *params, const char *name,
+                            int *offset, int *size);
+int rkflash_parse_mtdparts(const char *params, struct rkflash_partition *parts,
+                           int max);
+int rkflash_read_partitions(rkflash *f, struct rkflash_partition *parts, int max,
+                            uint32_t *crc);
+
+/* SDRAM and IDB */
+int rkflash_read_sdram(rkflash *f, uint32_t addr, uint8_t *data, int len);
+int rkflash_write_sdram(rkflash *f, uint32_t addr, const uint8_t *data, int len);
+int rkflash_exec(rkflash *f, uint32_t krnl_addr, uint32_t parm_addr);
+int rkflash_read_idb(rkflash *f, int offset, int nsectors, uint8_t *data);
+int rkflash_write_idb(rkflash *f, int offset, const uint8_t *data, int len);
+
+#endif
@@ -24,14 +24,21 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* copy_file_range */
+#endif
+
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "rkcrc.h"
 #include "rkflashtool.h"
@@ -41,6 +48,12 @@
 #define O_BINARY 0
 #endif
 
+#define GET32LE(x) ((uint32_t)(x)[0] | (x)[1] << 8 | (x)[2] << 16 | (uint32_t)(x)[3] << 24)
+
+#define CHUNK_MIN       0x1000000   /* smaller inputs are not worth a thread */
+#define COPY_BUFSIZE    0x100000
+#define READ_BUFSIZE    0x10000     /* for pipes */
+
 static const char headers[2][4] = { "KRNL", "PARM" };
 
 static const char *const strings[2] = { "info", "fatal" };
@@ -57,29 +70,162 @@ static void info_and_fatal(const int s, char *f, ...) {
 #define info(...)   info_and_fatal(0, __VA_ARGS__)
 #define fatal(...)  info_and_fatal(1, __VA_ARGS__)
 
+/* Regular input files are mapped and the CRC is computed straight over
+ * the mapping, split into one chunk per thread with -j. Each thread does
+ * its chunk from 0 and rkcrc32_combine() joins the chunk CRCs in file
+ * order, which gives the same result as one pass over the file.
+ */
+
+struct chunk {
+    const uint8_t *p;
+    uint64_t size;
+    uint32_t crc;
+    pthread_t thread;
+};
+
+static void *crc_chunk(void *arg) {
+    struct chunk *c = arg;
+
+    c->crc = rkcrc32(0, (uint8_t *)c->p, c->size);
+    return NULL;
+}
+
+static uint32_t crc_buf(const uint8_t *p, uint64_t size, int njobs) {
+    struct chunk *c;
+    uint64_t step;
+    uint32_t crc = 0;
+    int i;
+
+    if (njobs > (int)((size + CHUNK_MIN - 1) / CHUNK_MIN))
+        njobs = (size + CHUNK_MIN - 1) / CHUNK_MIN;
+    if (njobs <= 1)
+        return rkcrc32(0, (uint8_t *)p, size);
+
+    if (!(c = calloc(njobs, sizeof(*c))))
+        fatal("out of memory\n");
+
+    step = (size + njobs - 1) / njobs;
+    for (i = 0; i < njobs; i++) {
+        c[i].p    = p + i * step;
+        c[i].size = size - i * step < step ? size - i * step : step;
+        if (pthread_create(&c[i].thread, NULL, crc_chunk, &c[i]))
+            fatal("cannot create thread\n");
+    }
+
+    for (i = 0; i < njobs; i++) {
+        pthread_join(c[i].thread, NULL);
+        crc = rkcrc32_combine(crc, c[i].crc, c[i].size);
+    }
+
+    free(c);
+    return crc;
+}
+
+static const uint8_t *map_file(int fd, off_t size) {
+    void *p;
+
+    if (size <= 0 ||
+        (p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(p, size, MADV_SEQUENTIAL);
+#endif
+    return p;
+}
+
+/* Appends size bytes of in, also mapped at map, to out. The kernel does
+ * the copy where it can, which is a reflink on filesystems that share
+ * extents when the output offset is block aligned, i.e. without header.
+ */
+static void copy_payload(int in, int out, const uint8_t *map, off_t size,
+                         const char *outname) {
+    off_t pos = 0;
+    ssize_t nr;
+#ifdef __linux__
+    loff_t off_in = 0;
+
+    while (pos < size &&
+           (nr = copy_file_range(in, &off_in, out, NULL, size - pos, 0)) > 0)
+        pos += nr;
+    /* if it is not supported here, write what is left from the mapping */
+#endif
+
+    for (; pos < size; pos += nr)
+        if ((nr = write(out, map + pos, size - pos < COPY_BUFSIZE ? size - pos
+                                                                   : COPY_BUFSIZE)) <= 0)
+            fatal("%s: write error\n", outname);
+}
+
+/* Verifies a file signed by rkcrc, with or without KRNL/PARM header */
+static int check(const char *name, int njobs) {
+    const uint8_t *map;
+    struct stat st;
+    uint32_t crc, len, hdr = 0;
+    int fd;
+
+    if ((fd = open(name, O_BINARY | O_RDONLY)) == -1 || fstat(fd, &st) != 0)
+        fatal("%s: %s\n", name, strerror(errno));
+    if (st.st_size < 4)
+        fatal("%s: too short to be signed\n", name);
+    if (!(map = map_file(fd, st.st_size)))
+        fatal("%s: %s\n", name, strerror(errno));
+
+    len = st.st_size - 4;
+    if (st.st_size >= 12 && (!memcmp(map, headers[0], 4) ||
+                             !memcmp(map, headers[1], 4)) &&
+        GET32LE(map + 4) == (uint64_t)st.st_size - 12) {
+        info("%.4s header, %u bytes\n", map, GET32LE(map + 4));
+        hdr = 8;
+        len = GET32LE(map + 4);
+    }
+
+    crc = crc_buf(map + hdr, len, njobs);
+    if (crc != GET32LE(map + hdr + len))
+        fatal("%s: CRC mismatch (stored 0x%08x, computed 0x%08x)\n",
+              name, GET32LE(map + hdr + len), crc);
+    info("%s: CRC OK (0x%08x)\n", name, crc);
+
+    munmap((void *)map, st.st_size);
+    close(fd);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        { "check", no_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    const uint8_t *map;
     struct stat st;
     ssize_t nr;
     uint32_t crc = 0;
-    uint8_t buf[512];
+    uint8_t buf[READ_BUFSIZE];
     char *progname = argv[0];
-    int ch, which = -1, in, out;
+    int ch, which = -1, in, out, njobs = 1, checking = 0;
 
-    while ((ch = getopt(argc, argv, "kp")) != -1) {
+    while ((ch = getopt_long(argc, argv, "kpj:c", longopts, NULL)) != -1) {
         switch (ch) {
         case 'k': which = 0; break;
         case 'p': which = 1; break;
+        case 'c': checking = 1; break;
+        case 'j':
+            if ((njobs = atoi(optarg)) <= 0)
+                njobs = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
         default: break;
         }
     }
     argc -= optind;
     argv += optind;
 
-    if (argc != 2)
-        fatal("rkcrc v%d.%d\nusage: %s [-k|-p] infile outfile\n",
+    if (argc != 2 - checking)
+        fatal("rkcrc v%d.%d\nusage: %s [-k|-p] [-j threads] infile outfile\n"
+              "       %s --check [-j threads] file\n",
                     RKFLASHTOOL_VERSION_MAJOR,
-                    RKFLASHTOOL_VERSION_MINOR, progname);
+                    RKFLASHTOOL_VERSION_MINOR, progname, progname);
 
+    if (checking)
+        return check(argv[0], njobs);
 
     if ((in = open(argv[0], O_BINARY | O_RDONLY)) == -1)
         fatal("%s: %s\n", argv[0], strerror(errno));
@@ -97,10 +243,17 @@ int main(int argc, char *argv[]) {
           fatal("%s: write error\n", argv[1]);
     }
 
-    while ((nr = read(in, buf, sizeof(buf))) > 0) {
-        crc = rkcrc32(crc, buf, nr);
-        if(write(out, buf, nr) != nr)
-          fatal("%s: write error\n", argv[1]);
+    /* pipes, empty files and mmap failures go the old way */
+    if (S_ISREG(st.st_mode) && (map = map_file(in, st.st_size))) {
+        crc = crc_buf(map, st.st_size, njobs);
+        copy_payload(in, out, map, st.st_size, argv[1]);
+        munmap((void *)map, st.st_size);
+    } else {
+        while ((nr = read(in, buf, sizeof(buf))) > 0) {
+            crc = rkcrc32(crc, buf, nr);
+            if(write(out, buf, nr) != nr)
+              fatal("%s: write error\n", argv[1]);
+        }
     }
 
     PUT32LE(buf, crc);
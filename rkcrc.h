@@ -27,6 +27,9 @@
 #define _RKCRC_H_
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #ifdef SLOW
 static inline uint16_t
@@ -209,8 +212,32 @@ rkcrc16(uint16_t crc, uint8_t *buf, uint64_t size)
 	return crc;
 }
 
+/*
+ * rkcrc32 is MSB first and not reflected, so the common CRC-32 code does
+ * not apply. The byte at a time table walk stays as the reference; on top
+ * of it there are slicing-by-8 and -16 and a carry-less multiply folding
+ * kernel (PCLMULQDQ on x86, PMULL on arm64), picked at first use by what
+ * the CPU supports. RKCRC32=table|slice8|slice16|clmul overrides this.
+ */
+
+typedef uint32_t (*rkcrc32_fn)(uint32_t, const uint8_t *, uint64_t);
+
+struct rkcrc32_variant {
+	const char *name;
+	rkcrc32_fn fn;
+};
+
+static uint32_t crc32slice[16][256];
+static uint64_t crc32fold[8];   /* x^128, x^192, ... x^576 mod P */
+static struct rkcrc32_variant rkcrc32_variants[5];
+static rkcrc32_fn rkcrc32_best;
+static pthread_once_t rkcrc32_once = PTHREAD_ONCE_INIT;
+
+#define RKCRC_GET32BE(p) \
+	((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
 static inline uint32_t
-rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
+rkcrc32_table(uint32_t crc, const uint8_t *buf, uint64_t size)
 {
 
 	while (size-- > 0)
@@ -218,6 +245,297 @@ rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
 
 	return crc;
 }
+
+static inline uint32_t
+rkcrc32_slice8(uint32_t crc, const uint8_t *buf, uint64_t size)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32slice;
+	uint32_t a, b;
+
+	for (; size >= 8; buf += 8, size -= 8) {
+		a = crc ^ RKCRC_GET32BE(buf);
+		b = RKCRC_GET32BE(buf + 4);
+		crc = t[7][a >> 24] ^ t[6][(a >> 16) & 0xff] ^
+		      t[5][(a >> 8) & 0xff] ^ t[4][a & 0xff] ^
+		      t[3][b >> 24] ^ t[2][(b >> 16) & 0xff] ^
+		      t[1][(b >> 8) & 0xff] ^ t[0][b & 0xff];
+	}
+
+	return rkcrc32_table(crc, buf, size);
+}
+
+static inline uint32_t
+rkcrc32_slice16(uint32_t crc, const uint8_t *buf, uint64_t size)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32slice;
+	uint32_t a, b, c, d;
+
+	for (; size >= 16; buf += 16, size -= 16) {
+		a = crc ^ RKCRC_GET32BE(buf);
+		b = RKCRC_GET32BE(buf + 4);
+		c = RKCRC_GET32BE(buf + 8);
+		d = RKCRC_GET32BE(buf + 12);
+		crc = t[15][a >> 24] ^ t[14][(a >> 16) & 0xff] ^
+		      t[13][(a >> 8) & 0xff] ^ t[12][a & 0xff] ^
+		      t[11][b >> 24] ^ t[10][(b >> 16) & 0xff] ^
+		      t[9][(b >> 8) & 0xff] ^ t[8][b & 0xff] ^
+		      t[7][c >> 24] ^ t[6][(c >> 16) & 0xff] ^
+		      t[5][(c >> 8) & 0xff] ^ t[4][c & 0xff] ^
+		      t[3][d >> 24] ^ t[2][(d >> 16) & 0xff] ^
+		      t[1][(d >> 8) & 0xff] ^ t[0][d & 0xff];
+	}
+
+	return rkcrc32_slice8(crc, buf, size);
+}
+
+/* x^n mod P */
+static inline uint32_t
+rkcrc32_xpow(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n-- > 0)
+		r = r & 0x80000000 ? (r << 1) ^ 0x04c10db7 : r << 1;
+
+	return r;
+}
+
+/*
+ * Folding: with the data taken as one big polynomial, 16 bytes loaded
+ * big endian are a 128 bit piece of it with bit i the coefficient of x^i,
+ * which is exactly what the carry-less multiply works on. A piece H:L that
+ * is d bits ahead of the end of the data is moved forward by replacing it
+ * with H * (x^(d+64) mod P) + L * (x^d mod P), at most 96 bits. Four
+ * accumulators fold over 512 bits at a time, are folded into one and the
+ * last 128 bits are finished with the table code, like the tail.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RKCRC_CLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+rkcrc32_fold(__m128i a, __m128i k)
+{
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+			     _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline uint32_t
+rkcrc32_clmul(uint32_t crc, const uint8_t *buf, uint64_t size)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					  8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k128 = _mm_set_epi64x(crc32fold[1], crc32fold[0]);
+	const __m128i k256 = _mm_set_epi64x(crc32fold[3], crc32fold[2]);
+	const __m128i k384 = _mm_set_epi64x(crc32fold[5], crc32fold[4]);
+	const __m128i k512 = _mm_set_epi64x(crc32fold[7], crc32fold[6]);
+	__m128i a0, a1, a2, a3;
+	uint8_t tmp[16];
+
+	if (size < 128)
+		return rkcrc32_slice16(crc, buf, size);
+
+#define LOAD(p) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap)
+	a0 = _mm_xor_si128(LOAD(buf), _mm_set_epi32((int)crc, 0, 0, 0));
+	a1 = LOAD(buf + 16);
+	a2 = LOAD(buf + 32);
+	a3 = LOAD(buf + 48);
+	for (buf += 64, size -= 64; size >= 64; buf += 64, size -= 64) {
+		a0 = _mm_xor_si128(rkcrc32_fold(a0, k512), LOAD(buf));
+		a1 = _mm_xor_si128(rkcrc32_fold(a1, k512), LOAD(buf + 16));
+		a2 = _mm_xor_si128(rkcrc32_fold(a2, k512), LOAD(buf + 32));
+		a3 = _mm_xor_si128(rkcrc32_fold(a3, k512), LOAD(buf + 48));
+	}
+	a0 = _mm_xor_si128(_mm_xor_si128(rkcrc32_fold(a0, k384),
+					 rkcrc32_fold(a1, k256)),
+			   _mm_xor_si128(rkcrc32_fold(a2, k128), a3));
+	for (; size >= 16; buf += 16, size -= 16)
+		a0 = _mm_xor_si128(rkcrc32_fold(a0, k128), LOAD(buf));
+#undef LOAD
+
+	_mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(a0, swap));
+	crc = rkcrc32_table(0, tmp, 16);
+
+	return rkcrc32_table(crc, buf, size);
+}
+
+static inline int
+rkcrc32_have_clmul(void)
+{
+	unsigned int a, b, c, d;
+
+	return __get_cpuid(1, &a, &b, &c, &d) &&
+	       (c & bit_PCLMUL) && (c & bit_SSSE3);
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define RKCRC_CLMUL
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t
+rkcrc32_fold(uint64x2_t a, poly64_t khi, poly64_t klo)
+{
+
+	return veorq_u64(
+	    vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 1), khi)),
+	    vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 0), klo)));
+}
+
+/* 16 bytes big endian: lane 1 is the first 8 */
+static inline uint64x2_t
+rkcrc32_load(const uint8_t *p)
+{
+	uint64x2_t v = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(p)));
+
+	return vextq_u64(v, v, 1);
+}
+
+__attribute__((target("+crypto")))
+static inline uint32_t
+rkcrc32_clmul(uint32_t crc, const uint8_t *buf, uint64_t size)
+{
+	const poly64_t k128h = crc32fold[1], k128l = crc32fold[0];
+	const poly64_t k256h = crc32fold[3], k256l = crc32fold[2];
+	const poly64_t k384h = crc32fold[5], k384l = crc32fold[4];
+	const poly64_t k512h = crc32fold[7], k512l = crc32fold[6];
+	uint64x2_t a0, a1, a2, a3;
+	uint64_t h, l;
+	uint8_t tmp[16];
+	int i;
+
+	if (size < 128)
+		return rkcrc32_slice16(crc, buf, size);
+
+	a0 = veorq_u64(rkcrc32_load(buf), vcombine_u64(vcreate_u64(0),
+					vcreate_u64((uint64_t)crc << 32)));
+	a1 = rkcrc32_load(buf + 16);
+	a2 = rkcrc32_load(buf + 32);
+	a3 = rkcrc32_load(buf + 48);
+	for (buf += 64, size -= 64; size >= 64; buf += 64, size -= 64) {
+		a0 = veorq_u64(rkcrc32_fold(a0, k512h, k512l), rkcrc32_load(buf));
+		a1 = veorq_u64(rkcrc32_fold(a1, k512h, k512l), rkcrc32_load(buf + 16));
+		a2 = veorq_u64(rkcrc32_fold(a2, k512h, k512l), rkcrc32_load(buf + 32));
+		a3 = veorq_u64(rkcrc32_fold(a3, k512h, k512l), rkcrc32_load(buf + 48));
+	}
+	a0 = veorq_u64(veorq_u64(rkcrc32_fold(a0, k384h, k384l),
+				 rkcrc32_fold(a1, k256h, k256l)),
+		       veorq_u64(rkcrc32_fold(a2, k128h, k128l), a3));
+	for (; size >= 16; buf += 16, size -= 16)
+		a0 = veorq_u64(rkcrc32_fold(a0, k128h, k128l), rkcrc32_load(buf));
+
+	h = vgetq_lane_u64(a0, 1);
+	l = vgetq_lane_u64(a0, 0);
+	for (i = 0; i < 8; i++) {
+		tmp[i]     = h >> (56 - 8 * i);
+		tmp[i + 8] = l >> (56 - 8 * i);
+	}
+	crc = rkcrc32_table(0, tmp, 16);
+
+	return rkcrc32_table(crc, buf, size);
+}
+
+static inline int
+rkcrc32_have_clmul(void)
+{
+
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+static inline void
+rkcrc32_init(void)
+{
+	struct rkcrc32_variant *v = rkcrc32_variants;
+	const char *env = getenv("RKCRC32");
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32slice[0][i] = crc32table[i];
+		for (k = 1; k < 16; k++)
+			crc32slice[k][i] = (crc32slice[k - 1][i] << 8) ^
+			    crc32table[crc32slice[k - 1][i] >> 24];
+	}
+	for (i = 0; i < 8; i++)
+		crc32fold[i] = rkcrc32_xpow(128 + 64 * i);
+
+	/* fastest last */
+	v->name = "table";   (v++)->fn = rkcrc32_table;
+	v->name = "slice8";  (v++)->fn = rkcrc32_slice8;
+	v->name = "slice16"; (v++)->fn = rkcrc32_slice16;
+#ifdef RKCRC_CLMUL
+	if (rkcrc32_have_clmul()) {
+		v->name = "clmul"; (v++)->fn = rkcrc32_clmul;
+	}
+#endif
+	rkcrc32_best = v[-1].fn;
+
+	for (v = rkcrc32_variants; env && v->name; v++)
+		if (!strcmp(env, v->name))
+			rkcrc32_best = v->fn;
+}
+
+/* The variants usable on this CPU, ending with a NULL name */
+static inline const struct rkcrc32_variant *
+rkcrc32_list(void)
+{
+
+	pthread_once(&rkcrc32_once, rkcrc32_init);
+	return rkcrc32_variants;
+}
+
+static inline uint32_t
+rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+
+	pthread_once(&rkcrc32_once, rkcrc32_init);
+	return rkcrc32_best(crc, buf, size);
+}
 #endif
 
+/* a * b mod P */
+static inline uint32_t
+rkcrc32_mulmod(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 31; i >= 0; i--) {
+		r = r & 0x80000000 ? (r << 1) ^ 0x04c10db7 : r << 1;
+		if (b & (1U << i))
+			r ^= a;
+	}
+
+	return r;
+}
+
+/*
+ * rkcrc32 of A followed by B, from crc1 = rkcrc32(crc, A) and
+ * crc2 = rkcrc32(0, B): crc1 is moved past the len2 bytes of B by
+ * multiplying it with x^(8 * len2) mod P, so chunks of a file can be
+ * done in any order or in parallel.
+ */
+static inline uint32_t
+rkcrc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	uint32_t x = 0x100;	/* x^8 */
+	uint32_t xn = 1;
+
+	for (; len2; len2 >>= 1) {
+		if (len2 & 1)
+			xn = rkcrc32_mulmod(xn, x);
+		x = rkcrc32_mulmod(x, x);
+	}
+
+	return rkcrc32_mulmod(crc1, xn) ^ crc2;
+}
+
 #endif /* !_RKCRC_H_ */
@@ -0,0 +1,438 @@
+/* rkemu - software RockChip loader for librkflash
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The emulator is a librkflash transport that answers the USBC/USBS
+ * protocol of doc/protocol.txt in-process. The LBA space is a (sparse)
+ * image file, SDRAM and the IDB sectors live in memory.
+ *
+ * Timing follows a simple model of a device that handles one command at
+ * a time: every command costs a fixed latency, counted from the moment
+ * it is sent, and every data phase costs its size divided by the
+ * bandwidth. Synchronous transfers sleep until the device is done, the
+ * slots of the pipelined reader only when they are waited for, so
+ * commands in flight overlap their latency just like on real hardware.
+ *
+ * spec is file[,latency=us][,bandwidth=MB/s][,size=nsectors][,max=nsectors]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <libusb.h>
+
+#include "librkflash.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define RKEMU_FLASH_SIZE    0x400000    /* sectors, 2GB */
+#define RKEMU_BLOCK_SIZE    0x200       /* sectors per erase block, 256kB */
+#define RKEMU_MAX_XFER      0x800       /* largest LBA transfer accepted */
+#define RKEMU_SDRAM_SIZE    0x1000000
+#define RKEMU_IDB_SECTORS   0x400
+
+#define GETBE16(x) ((x)[0] << 8 | (x)[1])
+#define GETBE32(x) ((uint32_t)(x)[0] << 24 | (x)[1] << 16 | (x)[2] << 8 | (x)[3])
+
+struct rkemu {
+    int fd;
+    uint32_t flash_size;        /* sectors */
+    unsigned int max_xfer;      /* sectors */
+    double latency;             /* seconds per command */
+    double bandwidth;           /* bytes per second, 0 for unlimited */
+    double busy;                /* time the device is done with everything */
+    uint8_t *sdram, *idb;
+
+    /* the command in progress */
+    enum { IDLE, DATA_IN, DATA_OUT, STATUS, HALTED } state;
+    uint8_t tag[4];
+    uint32_t command, offset;
+    uint16_t count;
+    uint8_t status;
+    uint8_t *buf;
+    unsigned int len, pos, size;
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+    struct timespec ts;
+    double d = t - now();
+
+    if (d <= 0)
+        return;
+    ts.tv_sec  = d;
+    ts.tv_nsec = (d - ts.tv_sec) * 1e9;
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+/* Accounts for a command sent at time t, or for len bytes of data */
+static void charge(struct rkemu *e, double t, unsigned int len) {
+    if (t) {
+        if (e->busy < t + e->latency)
+            e->busy = t + e->latency;
+    } else if (e->bandwidth) {
+        e->busy += len / e->bandwidth;
+    }
+}
+
+static int grow(struct rkemu *e, unsigned int len) {
+    uint8_t *p;
+
+    if (len > e->size) {
+        if (!(p = realloc(e->buf, len)))
+            return -1;
+        e->buf  = p;
+        e->size = len;
+    }
+    e->len = len;
+    e->pos = 0;
+    return 0;
+}
+
+static int lba_ok(struct rkemu *e, uint32_t offset, uint32_t n) {
+    return offset <= e->flash_size && n <= e->flash_size - offset;
+}
+
+static void fill_info(struct rkemu *e, uint8_t *p) {
+    nand_info *nand = (nand_info *)p;
+
+    memset(p, 0, 512);
+    nand->flash_size      = e->flash_size;
+    nand->block_size      = RKEMU_BLOCK_SIZE;
+    nand->page_size       = 8;
+    nand->ecc_bits        = 40;
+    nand->access_time     = 32;
+    nand->manufacturer_id = 0;
+    nand->chip_select     = 1;
+}
+
+/* Decodes a command block and prepares its data phase. Commands with data
+ * for the host are carried out right away, the others once their data has
+ * arrived.
+ */
+static int emu_command(struct rkemu *e, const uint8_t *cbw) {
+    uint32_t addr;
+    unsigned int len = 0;
+    int in = 0, out = 0;
+
+    memcpy(e->tag, cbw + 4, 4);
+    e->command = GETBE32(cbw + 12);
+    e->offset  = GETBE32(cbw + 17);
+    e->count   = GETBE16(cbw + 22);
+    e->status  = 0;
+    addr = e->offset;
+
+    switch (e->command) {
+    case RKFT_CMD_TESTUNITREADY:
+    case RKFT_CMD_RESETDEVICE:
+    case RKFT_CMD_EXECUTESDRAM:
+        break;
+    case RKFT_CMD_READFLASHID:
+        in = 1; len = 5;
+        break;
+    case RKFT_CMD_READFLASHINFO:
+        in = 1; len = 512;
+        break;
+    case RKFT_CMD_READCHIPINFO:
+        in = 1; len = 16;
+        break;
+    case RKFT_CMD_READLBA:
+    case RKFT_CMD_WRITELBA:
+        if (e->count > e->max_xfer) {
+            /* like a loader that cannot take it: stall until cleared */
+            e->state = HALTED;
+            return 0;
+        }
+        in  = e->command == RKFT_CMD_READLBA;
+        out = !in;
+        len = e->count << 9;
+        if (!lba_ok(e, e->offset, e->count))
+            e->status = 1;
+        break;
+    case RKFT_CMD_ERASESECTORS:
+        if (!lba_ok(e, e->offset, e->count) ||
+            e->offset % RKEMU_BLOCK_SIZE || e->count % RKEMU_BLOCK_SIZE)
+            e->status = 1;
+        break;
+    case RKFT_CMD_READSECTOR:
+    case RKFT_CMD_WRITESECTOR:
+        in  = e->command == RKFT_CMD_READSECTOR;
+        out = !in;
+        len = e->count * RKFT_IDB_BLOCKSIZE;
+        if (e->offset > RKEMU_IDB_SECTORS || e->count > RKEMU_IDB_SECTORS - e->offset)
+            e->status = 1;
+        break;
+    case RKFT_CMD_READSDRAM:
+    case RKFT_CMD_WRITESDRAM:
+        in  = e->command == RKFT_CMD_READSDRAM;
+        out = !in;
+        len = e->count;
+        if (addr > RKEMU_SDRAM_SIZE || len > RKEMU_SDRAM_SIZE - addr)
+            e->status = 1;
+        break;
+    default:
+        e->status = 1;
+    }
+
+    if (grow(e, len))
+        return -1;
+    memset(e->buf, 0, len);
+    e->state = in ? DATA_IN : out ? DATA_OUT : STATUS;
+
+    if (e->status)
+        return 0;
+
+    switch (e->command) {
+    case RKFT_CMD_READFLASHID:
+        memcpy(e->buf, "\xec\xd7\x94\x76\x00", 5);
+        break;
+    case RKFT_CMD_READFLASHINFO:
+        fill_info(e, e->buf);
+        break;
+    case RKFT_CMD_READCHIPINFO:
+        memcpy(e->buf, "0UME410261010000", 16);
+        break;
+    case RKFT_CMD_READLBA:
+        if (pread(e->fd, e->buf, len, (off_t)e->offset << 9) != (ssize_t)len)
+            e->status = 1;
+        break;
+    case RKFT_CMD_ERASESECTORS:
+        if (grow(e, RKEMU_BLOCK_SIZE << 9))
+            return -1;
+        memset(e->buf, 0xff, e->len);
+        for (; e->count; e->count -= RKEMU_BLOCK_SIZE, e->offset += RKEMU_BLOCK_SIZE)
+            if (pwrite(e->fd, e->buf, e->len, (off_t)e->offset << 9) != (ssize_t)e->len)
+                e->status = 1;
+        e->len = 0;
+        break;
+    case RKFT_CMD_READSECTOR:
+        memcpy(e->buf, e->idb + e->offset * RKFT_IDB_BLOCKSIZE, len);
+        break;
+    case RKFT_CMD_READSDRAM:
+        memcpy(e->buf, e->sdram + addr, len);
+        break;
+    }
+    return 0;
+}
+
+static void emu_write(struct rkemu *e) {
+    if (e->status)
+        return;
+    switch (e->command) {
+    case RKFT_CMD_WRITELBA:
+        if (pwrite(e->fd, e->buf, e->len, (off_t)e->offset << 9) != (ssize_t)e->len)
+            e->status = 1;
+        break;
+    case RKFT_CMD_WRITESECTOR:
+        memcpy(e->idb + e->offset * RKFT_IDB_BLOCKSIZE, e->buf, e->len);
+        break;
+    case RKFT_CMD_WRITESDRAM:
+        memcpy(e->sdram + e->offset, e->buf, e->len);
+        break;
+    }
+}
+
+/* One bulk transfer at time t; returns the bytes moved or -1 for a stall */
+static int emu_transfer(struct rkemu *e, unsigned char ep, uint8_t *data,
+                        unsigned int len, double t) {
+    unsigned int n;
+
+    if (!(ep & LIBUSB_ENDPOINT_IN)) {
+        if (e->state == IDLE && len == 31 && !memcmp(data, "USBC", 4)) {
+            charge(e, t, 0);
+            return emu_command(e, data) ? -1 : (int)len;
+        }
+        if (e->state == DATA_OUT && len == e->len) {
+            memcpy(e->buf, data, len);
+            charge(e, 0, len);
+            emu_write(e);
+            e->state = STATUS;
+            return len;
+        }
+    } else {
+        if (e->state == DATA_IN) {
+            n = len < e->len - e->pos ? len : e->len - e->pos;
+            memcpy(data, e->buf + e->pos, n);
+            charge(e, 0, n);
+            if ((e->pos += n) == e->len)
+                e->state = STATUS;
+            return n;
+        }
+        if (e->state == STATUS && len >= 13) {
+            memset(data, 0, 13);
+            memcpy(data, "USBS", 4);
+            memcpy(data + 4, e->tag, 4);
+            data[12] = e->status;
+            e->state = IDLE;
+            return 13;
+        }
+    }
+    e->state = HALTED;
+    return -1;
+}
+
+static int emu_bulk(rkflash *f, unsigned char ep, uint8_t *data,
+                    unsigned int len, int *actual, unsigned int timeout) {
+    struct rkemu *e = f->tr_priv;
+    int n = emu_transfer(e, ep, data, len, now());
+
+    (void)timeout;
+    sleep_until(e->busy);
+    *actual = n < 0 ? 0 : n;
+    return n < 0 ? LIBUSB_ERROR_PIPE : 0;
+}
+
+static int emu_control(rkflash *f, uint16_t index, uint8_t *data, uint16_t len) {
+    struct rkemu *e = f->tr_priv;
+
+    /* loader images are accepted and forgotten */
+    (void)index; (void)data;
+    charge(e, now(), 0);
+    charge(e, 0, len);
+    sleep_until(e->busy);
+    return 0;
+}
+
+static int emu_submit(rkflash *f, struct rkflash_slot *s) {
+    struct rkemu *e = f->tr_priv;
+    double t = now();
+
+    if (emu_transfer(e, 2|LIBUSB_ENDPOINT_OUT, s->cmd, sizeof(s->cmd), t) < 0 ||
+        emu_transfer(e, 1|LIBUSB_ENDPOINT_IN, s->data, s->nsectors << 9, 0) < 0 ||
+        emu_transfer(e, 1|LIBUSB_ENDPOINT_IN, s->res, sizeof(s->res), 0) < 0) {
+        s->failed = 1;
+        e->state = IDLE;
+    }
+    s->due = e->busy;
+    return 0;
+}
+
+static int emu_wait(rkflash *f, struct rkflash_slot *s) {
+    (void)f;
+    sleep_until(s->due);
+    s->done = 1;
+    return 0;
+}
+
+static void emu_cancel(rkflash *f, struct rkflash_slot *s) {
+    (void)f;
+    s->done = 1;
+}
+
+static void emu_clear_halt(rkflash *f) {
+    struct rkemu *e = f->tr_priv;
+
+    e->state = IDLE;
+}
+
+static void emu_close(rkflash *f) {
+    struct rkemu *e = f->tr_priv;
+
+    if (!e)
+        return;
+    close(e->fd);
+    free(e->sdram);
+    free(e->idb);
+    free(e->buf);
+    free(e);
+    f->tr_priv = NULL;
+}
+
+static const struct rkflash_transport emu_transport = {
+    "emulator", emu_bulk, emu_control, emu_submit, emu_wait, emu_cancel,
+    emu_clear_halt, emu_close
+};
+
+static int parse_spec(struct rkemu *e, char *spec) {
+    char *opt, *val;
+
+    strtok(spec, ",");
+    while ((opt = strtok(NULL, ",")) != NULL) {
+        if (!(val = strchr(opt, '=')))
+            return -1;
+        *val++ = '\0';
+        if (!strcmp(opt, "latency"))
+            e->latency = strtod(val, NULL) / 1e6;
+        else if (!strcmp(opt, "bandwidth"))
+            e->bandwidth = strtod(val, NULL) * 1e6;
+        else if (!strcmp(opt, "size"))
+            e->flash_size = strtoul(val, NULL, 0);
+        else if (!strcmp(opt, "max"))
+            e->max_xfer = strtoul(val, NULL, 0);
+        else
+            return -1;
+    }
+    return 0;
+}
+
+/* Opens an emulated device as described by spec, under the given path */
+int rkflash_open_emulator(rkflash *f, const char *spec, const char *path) {
+    struct rkemu *e;
+    struct stat st;
+    char buf[4096];
+
+    rkflash_open_transport(f, &emu_transport, NULL, path, "emulator");
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    if (!(e = calloc(1, sizeof(*e))))
+        return RKFLASH_ENOMEM;
+    e->fd         = -1;
+    e->flash_size = RKEMU_FLASH_SIZE;
+    e->max_xfer   = RKEMU_MAX_XFER;
+    f->tr_priv    = e;
+
+    if (parse_spec(e, buf) || !e->max_xfer) {
+        rkflash_close(f);
+        return RKFLASH_EINVAL;
+    }
+
+    /* the image grows as a sparse file to the size of the flash */
+    if ((e->fd = open(buf, O_RDWR | O_CREAT | O_BINARY, 0644)) < 0 ||
+        fstat(e->fd, &st) ||
+        (st.st_size < (off_t)e->flash_size << 9 &&
+         ftruncate(e->fd, (off_t)e->flash_size << 9)) ||
+        !(e->sdram = calloc(1, RKEMU_SDRAM_SIZE)) ||
+        !(e->idb = malloc(RKEMU_IDB_SECTORS * RKFT_IDB_BLOCKSIZE))) {
+        rkflash_close(f);
+        return RKFLASH_ENODEV;
+    }
+    memset(e->idb, 0xff, RKEMU_IDB_SECTORS * RKFT_IDB_BLOCKSIZE);
+    return 0;
+}
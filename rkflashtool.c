@@ -32,101 +32,36 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <libusb.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 /* hack to set binary mode for stdin / stdout on Windows */
 #ifdef _WIN32
-#include <fcntl.h>
 int _CRT_fmode = _O_BINARY;
+#else
+#define O_BINARY 0
 #endif
 
 #include "version.h"
-#include "rkcrc.h"
 #include "rkflashtool.h"
+#include "librkflash.h"
 
-#define RKFT_BLOCKSIZE      0x4000      /* must be multiple of 512 */
-#define RKFT_IDB_DATASIZE   0x200
-#define RKFT_IDB_BLOCKSIZE  0x210
-#define RKFT_IDB_INCR       0x20
-#define RKFT_MEM_INCR       0x80
-#define RKFT_OFF_INCR       (RKFT_BLOCKSIZE>>9)
-#define MAX_PARAM_LENGTH    (128*512-12) /* cf. MAX_LOADER_PARAM in rkloader */
-#define SDRAM_BASE_ADDRESS  0x60000000
-
-#define RKFT_CMD_TESTUNITREADY      0x80000600
-#define RKFT_CMD_READFLASHID        0x80000601
-#define RKFT_CMD_READFLASHINFO      0x8000061a
-#define RKFT_CMD_READCHIPINFO       0x8000061b
-#define RKFT_CMD_READEFUSE          0x80000620
-
-#define RKFT_CMD_SETDEVICEINFO      0x00000602
-#define RKFT_CMD_ERASESYSTEMDISK    0x00000616
-#define RKFT_CMD_SETRESETFLASG      0x0000061e
-#define RKFT_CMD_RESETDEVICE        0x000006ff
-
-#define RKFT_CMD_TESTBADBLOCK       0x80000a03
-#define RKFT_CMD_READSECTOR         0x80000a04
-#define RKFT_CMD_READLBA            0x80000a14
-#define RKFT_CMD_READSDRAM          0x80000a17
-#define RKFT_CMD_UNKNOWN1           0x80000a21
-
-#define RKFT_CMD_WRITESECTOR        0x00000a05
-#define RKFT_CMD_ERASESECTORS       0x00000a06
-#define RKFT_CMD_UNKNOWN2           0x00000a0b
-#define RKFT_CMD_WRITELBA           0x00000a15
-#define RKFT_CMD_WRITESDRAM         0x00000a18
-#define RKFT_CMD_EXECUTESDRAM       0x00000a19
-#define RKFT_CMD_WRITEEFUSE         0x00000a1f
-#define RKFT_CMD_UNKNOWN3           0x00000a22
-
-#define RKFT_CMD_WRITESPARE         0x80001007
-#define RKFT_CMD_READSPARE          0x80001008
-
-#define RKFT_CMD_LOWERFORMAT        0x0000001c
-#define RKFT_CMD_WRITENKB           0x00000030
-
-#define SETBE16(a, v) do { \
-                        ((uint8_t*)a)[1] =  v      & 0xff; \
-                        ((uint8_t*)a)[0] = (v>>8 ) & 0xff; \
-                      } while(0)
-
-#define SETBE32(a, v) do { \
-                        ((uint8_t*)a)[3] =  v      & 0xff; \
-                        ((uint8_t*)a)[2] = (v>>8 ) & 0xff; \
-                        ((uint8_t*)a)[1] = (v>>16) & 0xff; \
-                        ((uint8_t*)a)[0] = (v>>24) & 0xff; \
-                      } while(0)
-
-static const struct t_pid {
-    const uint16_t pid;
-    const char name[8];
-} pidtab[] = {
-    { 0x281a, "RK2818" },
-    { 0x290a, "RK2918" },
-    { 0x292a, "RK2928" },
-    { 0x292c, "RK3026" },
-    { 0x300a, "RK3066" },
-    { 0x300b, "RK3168" },
-    { 0x301a, "RK3036" },
-    { 0x310a, "RK3066B" },
-    { 0x310b, "RK3188" },
-    { 0x310c, "RK312X" }, // Both RK3126 and RK3128
-    { 0x310d, "RK3126" },
-    { 0x320a, "RK3288" },
-    { 0x320b, "RK322X" }, // Both RK3228 and RK3229
-    { 0x330a, "RK3368" },
-    { 0, "" },
-};
-
-typedef struct {
-    uint32_t flash_size;
-    uint16_t block_size;
-    uint8_t page_size;
-    uint8_t ecc_bits;
-    uint8_t access_time;
-    uint8_t manufacturer_id;
-    uint8_t chip_select;
-} nand_info;
+#define RKFT_RING_SIZE      16          /* blocks buffered ahead of WRITELBA */
+#define RKFT_WINDOW         (RKFT_RING_SIZE/2)  /* blocks compared per read-back */
+#define RKFT_MAX_DEVICES    32
+#define RKFT_MAX_STEPS      64
+#define RKFT_PROGRESS_SECS  2           /* progress interval with several devices */
 
 static const char* const manufacturer[] = {   /* NAND Manufacturers */
     "Samsung",
@@ -141,29 +76,110 @@ static const char* const manufacturer[] = {   /* NAND Manufacturers */
 };
 #define MAX_NAND_ID (sizeof manufacturer / sizeof(char *))
 
-static uint8_t cmd[31], res[13], buf[RKFT_BLOCKSIZE];
-static uint8_t ibuf[RKFT_IDB_BLOCKSIZE];
-static libusb_context *c;
-static libusb_device_handle *h = NULL;
-static int tmp;
+/* An action with its arguments. A batch runs several of them, in order,
+ * in one session with the device.
+ */
+struct step {
+    char action;
+    int offset, size;
+    uint8_t flag;
+    char *partname;
+    char *infile, *outfile;     /* <file and >file, instead of -i and -o */
+    char text[64];              /* as given, for messages */
+};
+
+/* how w, P and U write, which requests to the daemon can change */
+struct options {
+    int probe, delta, verify, verify_retries;
+    unsigned int xfer_size;
+    enum rkflash_sparse sparse;
+};
 
-static const char *const strings[2] = { "info", "fatal" };
+/* command line, the same for every device */
+static struct step steps[RKFT_MAX_STEPS];
+static int nsteps;
+static char *infile, *outfile;
+static struct options options;
+static const char *cachedir;
+static const char *selected[RKFT_MAX_DEVICES];
+static int nselected, all;
+static const char *emulated[RKFT_MAX_DEVICES];
+static int nemulated;
+
+/* actions that read input and actions that write output */
+static const char inputs[] = "lLwPMjU", outputs[] = "rpmiT";
+
+static __thread const char *devpath;    /* set when working on several devices */
+static __thread time_t last;
+static __thread char lasterror[256];    /* for the replies of the daemon */
+static __thread int liberror;           /* RKFLASH_E* code of the last lib_error() */
+
+static const char *const strings[3] = { "info", "fatal", "fatal" };
+
+/* s is 0 for info, 1 for fatal and 2 for fatal to this device only, path
+ * is the device to prefix the message with
+ */
+static void vmessage(const char *path, const int s, const int cr,
+                     const char *f, va_list ap) {
+    char line[1024];
+    size_t n;
+    va_list aq;
+
+    if (s == 2) {
+        va_copy(aq, ap);
+        vsnprintf(lasterror, sizeof(lasterror), f, aq);
+        va_end(aq);
+    }
+    if (!path) {
+        fprintf(stderr, "%srkflashtool: %s: ", cr ? "\r" : "", strings[s]);
+        vfprintf(stderr, f, ap);
+    } else if (!cr || f[strlen(f)-1] == '\n' ||
+               time(NULL) - last >= RKFT_PROGRESS_SECS) {
+        /* one line per write, and progress lines only now and then, so
+         * the output of several devices does not get mixed up */
+        n = snprintf(line, sizeof(line), "rkflashtool: [%s] %s: ",
+                     path, strings[s]);
+        vsnprintf(line + n, sizeof(line) - n - 1, f, ap);
+        if (line[strlen(line)-1] != '\n')
+            strcat(line, "\n");
+        fputs(line, stderr);
+        if (cr)
+            last = time(NULL);
+    }
+    if (s == 1) exit(s);
+}
 
 static void info_and_fatal(const int s, const int cr, char *f, ...) {
     va_list ap;
+
     va_start(ap,f);
-    fprintf(stderr, "%srkflashtool: %s: ", cr ? "\r" : "", strings[s]);
-    vfprintf(stderr, f, ap);
+    vmessage(devpath, s, cr, f, ap);
     va_end(ap);
-    if (s) exit(s);
 }
 
 #define info(...)    info_and_fatal(0, 0, __VA_ARGS__)
 #define infocr(...)  info_and_fatal(0, 1, __VA_ARGS__)
 #define fatal(...)   info_and_fatal(1, 0, __VA_ARGS__)
+#define fail(...)    (info_and_fatal(2, 0, __VA_ARGS__), 1)
+
+static int lib_error(int r) {
+    liberror = r;
+    return fail("%s\n", rkflash_strerror(r));
+}
+
+static void done(void) {
+    if (devpath)
+        info("done\n");
+    else
+        fprintf(stderr, "... Done!\n");
+}
 
 static void usage(void) {
-    fatal("usage:\n"
+    fatal("usage: rkflashtool [-a|-d path...|-X spec...] [-i infile] [-o outfile] [-s nsectors|auto]\n"
+          "                   [-S|-E] [-D] [-V] [-R n] action ... [, action ...]\n"
+          "       rkflashtool [options] -b script\n"
+          "       rkflashtool [options] -l socket\n"
+          "       rkflashtool -c socket [-d path] [-i infile] [-o outfile] action ... | -b script\n"
           "\trkflashtool b [flag]            \treboot device\n"
           "\trkflashtool l <file             \tload DDR init (MASK ROM MODE)\n"
           "\trkflashtool L <file             \tload USB loader (MASK ROM MODE)\n"
@@ -182,483 +198,1225 @@ static void usage(void) {
 //          "\trkflashtool g                 <infile  \twrite fuses\n"
           "\trkflashtool p >file             \tfetch parameters\n"
           "\trkflashtool P <file             \twrite parameters\n"
+          "\trkflashtool U <update.img       \tflash the partitions in update.img\n"
+          "\trkflashtool T                   \tlist partitions\n"
           "\trkflashtool e partname          \terase flash (fill with 0xff)\n"
           "\trkflashtool e offset nsectors   \terase flash (fill with 0xff)\n"
-         );
+          "\trkflashtool t                   \tprobe flash transfer sizes\n"
+          "options:\n"
+          "\t-a, --all     \twork on all connected devices in parallel\n"
+          "\t-d, --device path\twork on the device at USB path bus-port[.port...]\n"
+          "\t-X, --emulate spec\twork on an emulated device instead, spec is\n"
+          "\t              \tfile[,latency=us][,bandwidth=MB/s][,size=n][,max=n]\n"
+          "\t-i, --input file\tread input from file instead of stdin\n"
+          "\t-o, --output file\twrite output to file, or file.path for each device\n"
+          "\t-s nsectors   \tsectors per flash transfer (default %d)\n"
+          "\t-s auto       \tprobe the fastest transfer size first\n"
+          "\t-S, --sparse  \terase 0xff blocks of w input instead of writing them\n"
+          "\t-E, --erased  \tskip 0xff blocks of w input, target is already erased\n"
+          "\t-D, --delta   \tonly write blocks of w input that differ on the device\n"
+          "\t-V, --verify  \tread back and compare what w or P wrote\n"
+          "\t-R, --retry n \trewrite ranges that fail verification up to n times\n"
+          "\t-C, --cache dir\tkeep partition tables in dir between runs\n"
+          "\t-b, --batch script\trun the actions in script, one per line with\n"
+          "\t              \toptional <infile and >outfile, in one session\n"
+          "\t-l, --listen socket\tkeep the devices claimed and serve requests on socket\n"
+          "\t-c, --connect socket\trun the actions through the daemon on socket\n",
+          RKFT_OFF_INCR);
 }
 
-static void send_exec(uint32_t krnl_addr, uint32_t parm_addr) {
-    long int r = random();
+/* Buffered block input
+ *
+ * A reader thread fills a ring of transfer sized buffers from a file
+ * descriptor while the device thread drains them to the device, so a slow
+ * input pipe and the USB link work at the same time. Every block is read
+ * in full; only the last one before end-of-file may be short.
+ *
+ * Android sparse images are recognized by their magic and expanded on the
+ * fly. Their RAW chunks become data blocks, FILL chunks of 0xff become
+ * 0xff runs for rkflash_fill() and DONT_CARE chunks are skipped. Other
+ * fill values are expanded into data blocks.
+ */
 
-    memset(cmd, 0 , 31);
-    memcpy(cmd, "USBC", 4);
+struct rkft_block {
+    uint8_t *data;
+    ssize_t len;        /* bytes of data, 0 at end-of-file, -1 on error */
+    int fill;           /* sectors of 0xff instead of data */
+    int skip;           /* sectors to leave untouched instead of data */
+};
 
-    if (r)          SETBE32(cmd+4, r);
-    if (krnl_addr)  SETBE32(cmd+17, krnl_addr);
-    if (parm_addr)  SETBE32(cmd+22, parm_addr);
-                    SETBE32(cmd+12, RKFT_CMD_EXECUTESDRAM);
+struct rkft_ring {
+    struct rkft_block blk[RKFT_RING_SIZE];
+    unsigned int head, tail, count;
+    ssize_t size;
+    int fd, eof;
+    int stop;           /* set when the device thread is done with it */
+    const uint8_t *src; /* input in memory instead of fd */
+    size_t src_left;
+    pthread_t thread;
+    const char *path;   /* devpath of the device thread */
+    char error[128];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
 
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp, 0);
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_HEADER_SIZE      28
+#define CHUNK_HEADER_SIZE       12
+#define CHUNK_TYPE_RAW          0xcac1
+#define CHUNK_TYPE_FILL         0xcac2
+#define CHUNK_TYPE_DONT_CARE    0xcac3
+#define CHUNK_TYPE_CRC32        0xcac4
+
+#define GET16LE(x) ((x)[0] | (x)[1] << 8)
+#define GET32LE(x) ((uint32_t)(x)[0] | (x)[1] << 8 | (x)[2] << 16 | (uint32_t)(x)[3] << 24)
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void) {
+    uint32_t i, c;
+    int k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        crc32_table[i] = c;
+    }
 }
 
-static void send_reset(uint8_t flag) {
-    long int r = random();
-
-    memset(cmd, 0 , 31);
-    memcpy(cmd, "USBC", 4);
+/* CRC-32 as used by zlib and libsparse, unlike the rkcrc32 polynomial */
+static uint32_t sparse_crc32(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
 
-    SETBE32(cmd+4, r);
-    SETBE32(cmd+12, RKFT_CMD_RESETDEVICE);
-    cmd[16] = flag;
+/* Holes are checksummed as runs of one byte value without going over every
+ * byte: each byte is an affine map of the CRC register, x -> Mx ^ k, and
+ * the map for len bytes is found by repeated squaring. m[i] is the image
+ * of bit i.
+ */
+struct crc32_map {
+    uint32_t m[32], k;
+};
 
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp, 0);
+static uint32_t crc32_byte(uint32_t x) {
+    return crc32_table[x & 0xff] ^ (x >> 8);
 }
 
-static void send_cmd(uint32_t command, uint32_t offset, uint16_t nsectors) {
-    long int r = random();
+static uint32_t crc32_times(const uint32_t *m, uint32_t x) {
+    uint32_t r = 0;
 
-    memset(cmd, 0 , 31);
-    memcpy(cmd, "USBC", 4);
+    for (; x; x >>= 1, m++)
+        if (x & 1)
+            r ^= *m;
+    return r;
+}
 
-    if (r)          SETBE32(cmd+4, r);
-    if (offset)     SETBE32(cmd+17, offset);
-    if (nsectors)   SETBE16(cmd+22, nsectors);
-    if (command)    SETBE32(cmd+12, command);
+/* r = a after b */
+static void crc32_compose(struct crc32_map *r, const struct crc32_map *a,
+                          const struct crc32_map *b) {
+    struct crc32_map t;
+    int i;
 
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp, 0);
+    for (i = 0; i < 32; i++)
+        t.m[i] = crc32_times(a->m, b->m[i]);
+    t.k = crc32_times(a->m, b->k) ^ a->k;
+    *r = t;
 }
 
-static void send_buf(unsigned int s) {
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, buf, s, &tmp, 0);
+static uint32_t sparse_crc32_run(uint32_t crc, uint8_t c, uint64_t len) {
+    struct crc32_map step, run;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        step.m[i] = crc32_byte(1u << i);
+        run.m[i]  = 1u << i;
+    }
+    step.k = crc32_byte(c);
+    run.k  = 0;
+
+    for (; len; len >>= 1) {
+        if (len & 1)
+            crc32_compose(&run, &step, &run);
+        if (len > 1)
+            crc32_compose(&step, &step, &step);
+    }
+    return ~(crc32_times(run.m, ~crc) ^ run.k);
 }
 
-static void recv_res(void) {
-    libusb_bulk_transfer(h, 1|LIBUSB_ENDPOINT_IN, res, sizeof(res), &tmp, 0);
+static ssize_t read_full(struct rkft_ring *ring, uint8_t *p, ssize_t len) {
+    ssize_t nr, done = 0;
+
+    if (ring->src) {
+        done = (size_t)len < ring->src_left ? (size_t)len : ring->src_left;
+        memcpy(p, ring->src, done);
+        ring->src      += done;
+        ring->src_left -= done;
+        return done;
+    }
+
+    while (done < len && (nr = read(ring->fd, p + done, len - done)) != 0) {
+        if (nr < 0) {
+            snprintf(ring->error, sizeof(ring->error), "read error: %s",
+                     strerror(errno));
+            return -1;
+        }
+        done += nr;
+    }
+    return done;
 }
 
-static void recv_buf(unsigned int s) {
-    libusb_bulk_transfer(h, 1|LIBUSB_ENDPOINT_IN, buf, s, &tmp, 0);
+static struct rkft_block *ring_wait(struct rkft_ring *ring) {
+    struct rkft_block *b;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == RKFT_RING_SIZE && !ring->stop)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    if (ring->stop) {
+        /* the rest of the input is not wanted */
+        pthread_mutex_unlock(&ring->lock);
+        pthread_exit(NULL);
+    }
+    b = &ring->blk[ring->tail];
+    pthread_mutex_unlock(&ring->lock);
+
+    b->len = b->fill = b->skip = 0;
+    return b;
 }
 
-#define NEXT do { argc--;argv++; } while(0)
+static void ring_push(struct rkft_ring *ring, int eof) {
+    struct rkft_block *b = &ring->blk[ring->tail];
 
-int main(int argc, char **argv) {
-    struct libusb_device_descriptor desc;
-    const struct t_pid *ppid = pidtab;
-    ssize_t nr;
-    int offset = 0, size = 0;
-    uint16_t crc16;
-    uint8_t flag = 0;
-    char action;
-    char *partname = NULL;
+    pthread_mutex_lock(&ring->lock);
+    if (b->len || b->fill || b->skip) {
+        ring->tail = (ring->tail + 1) % RKFT_RING_SIZE;
+        ring->count++;
+    }
+    ring->eof = eof;
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
 
-    info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR,
-                                 RKFLASHTOOL_VERSION_MINOR);
+static void ring_raw(struct rkft_ring *ring, ssize_t len) {
+    struct rkft_block *b = &ring->blk[ring->tail];
 
-    NEXT; if (!argc) usage();
+    /* the first block already holds len bytes of peeked header */
+    for (;;) {
+        ssize_t nr = read_full(ring, b->data + len, ring->size - len);
 
-    action = **argv; NEXT;
+        b->len = nr < 0 ? -1 : len + nr;
+        if (b->len < ring->size) {
+            ring_push(ring, 1);
+            return;
+        }
+        ring_push(ring, 0);
+        b = ring_wait(ring);
+        len = 0;
+    }
+}
 
-    switch(action) {
-    case 'b':
-        if (argc > 1) usage();
-        else if (argc == 1)
-            flag = strtoul(argv[0], NULL, 0);
-        break;
-    case 'l':
-    case 'L':
-        if (argc) usage();
-        break;
-    case 'e':
-    case 'r':
-    case 'w':
-        if (argc < 1 || argc > 2) usage();
-        if (argc == 1) {
-            partname = argv[0];
+static int simg_error(struct rkft_ring *ring, const char *what) {
+    if (!*ring->error)
+        snprintf(ring->error, sizeof(ring->error), "sparse image: %s", what);
+    return -1;
+}
+
+/* Queues len bytes read from the input, or repeating the 4 byte pattern */
+static int simg_data(struct rkft_ring *ring, uint64_t len, uint32_t *crc,
+                     const uint8_t *pattern) {
+    struct rkft_block *b;
+    ssize_t i, n;
+
+    while (len) {
+        b = ring_wait(ring);
+        n = len < (uint64_t)ring->size ? (ssize_t)len : ring->size;
+        if (!pattern) {
+            if (read_full(ring, b->data, n) != n)
+                return simg_error(ring, "truncated RAW chunk");
         } else {
-            offset = strtoul(argv[0], NULL, 0);
-            size   = strtoul(argv[1], NULL, 0);
+            for (i = 0; i < n; i += 4)
+                memcpy(b->data + i, pattern, 4);
         }
-        break;
-    case 'm':
-    case 'M':
-    case 'B':
-    case 'i':
-    case 'j':
-        if (argc != 2) usage();
-        offset = strtoul(argv[0], NULL, 0);
-        size   = strtoul(argv[1], NULL, 0);
-        break;
-    case 'n':
-    case 'v':
-    case 'p':
-    case 'P':
-        if (argc) usage();
-        offset = 0;
-        size   = 1024;
-        break;
-    default:
-        usage();
+        *crc = sparse_crc32(*crc, b->data, n);
+        b->len = n;
+        ring_push(ring, 0);
+        len -= n;
     }
+    return 0;
+}
 
-    /* Initialize libusb */
-
-    if (libusb_init(&c)) fatal("cannot init libusb\n");
+static void simg_hole(struct rkft_ring *ring, uint64_t len, uint32_t *crc,
+                      int fill) {
+    struct rkft_block *b = ring_wait(ring);
 
-    libusb_set_debug(c, 3);
+    /* DONT_CARE counts as zeros in the checksum, like in libsparse */
+    *crc = sparse_crc32_run(*crc, fill ? 0xff : 0, len);
 
-    /* Detect connected RockChip device */
+    if (fill)
+        b->fill = len >> 9;
+    else
+        b->skip = len >> 9;
+    ring_push(ring, 0);
+}
 
-    while ( !h && ppid->pid) {
-        h = libusb_open_device_with_vid_pid(c, 0x2207, ppid->pid);
-        if (h) {
-            info("Detected %s...\n", ppid->name);
+static int ring_simg(struct rkft_ring *ring, uint8_t *hdr) {
+    uint32_t i, blk_sz, chunks, crc = 0;
+    uint8_t ch[CHUNK_HEADER_SIZE], skip[64];
+    unsigned int file_hdr_sz, chunk_hdr_sz;
+
+    file_hdr_sz  = GET16LE(hdr + 8);
+    chunk_hdr_sz = GET16LE(hdr + 10);
+    blk_sz       = GET32LE(hdr + 12);
+    chunks       = GET32LE(hdr + 20);
+
+    if (GET16LE(hdr + 4) != 1)
+        return simg_error(ring, "unsupported major version");
+    if (file_hdr_sz < SPARSE_HEADER_SIZE || chunk_hdr_sz < CHUNK_HEADER_SIZE ||
+        file_hdr_sz - SPARSE_HEADER_SIZE > sizeof(skip) ||
+        chunk_hdr_sz - CHUNK_HEADER_SIZE > sizeof(skip))
+        return simg_error(ring, "bad header size");
+    if (!blk_sz || blk_sz % 512)
+        return simg_error(ring, "block size is not a multiple of 512");
+
+    info("Android sparse image: %u blocks of %u bytes in %u chunks\n",
+         GET32LE(hdr + 16), blk_sz, chunks);
+
+    pthread_once(&crc32_once, crc32_init);
+
+    if (read_full(ring, skip, file_hdr_sz - SPARSE_HEADER_SIZE) !=
+                              (ssize_t)(file_hdr_sz - SPARSE_HEADER_SIZE))
+        return simg_error(ring, "truncated header");
+
+    for (i = 0; i < chunks; i++) {
+        uint32_t type, total;
+        uint64_t len;
+        uint8_t v[4];
+
+        if (read_full(ring, ch, CHUNK_HEADER_SIZE) != CHUNK_HEADER_SIZE ||
+            read_full(ring, skip, chunk_hdr_sz - CHUNK_HEADER_SIZE) !=
+                              (ssize_t)(chunk_hdr_sz - CHUNK_HEADER_SIZE))
+            return simg_error(ring, "truncated chunk header");
+
+        type  = GET16LE(ch);
+        len   = (uint64_t)GET32LE(ch + 4) * blk_sz;
+        total = GET32LE(ch + 8) - chunk_hdr_sz;
+
+        switch (type) {
+        case CHUNK_TYPE_RAW:
+            if (total != len)
+                return simg_error(ring, "bad RAW chunk size");
+            if (simg_data(ring, len, &crc, NULL))
+                return -1;
+            break;
+        case CHUNK_TYPE_FILL:
+            if (total != 4 || read_full(ring, v, 4) != 4)
+                return simg_error(ring, "bad FILL chunk");
+            if (GET32LE(v) == 0xffffffff)
+                simg_hole(ring, len, &crc, 1);
+            else if (simg_data(ring, len, &crc, v))
+                return -1;
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            if (total)
+                return simg_error(ring, "bad DONT_CARE chunk");
+            simg_hole(ring, len, &crc, 0);
+            break;
+        case CHUNK_TYPE_CRC32:
+            if (total != 4 || read_full(ring, v, 4) != 4)
+                return simg_error(ring, "bad CRC32 chunk");
+            if (GET32LE(v) != crc) {
+                snprintf(ring->error, sizeof(ring->error),
+                         "sparse image: bad CRC32! (%#x, should be %#x)",
+                         GET32LE(v), crc);
+                return -1;
+            }
             break;
+        default:
+            return simg_error(ring, "unknown chunk type");
         }
-        ppid++;
     }
-    if (!h) fatal("cannot open device\n");
 
-    /* Connect to device */
+    ring_wait(ring);
+    ring_push(ring, 1);
+    return 0;
+}
+
+static void *ring_reader(void *arg) {
+    struct rkft_ring *ring = arg;
+    uint8_t *hdr;
+    ssize_t len;
+
+    devpath = ring->path;
+
+    hdr = ring_wait(ring)->data;
+    len = read_full(ring, hdr, SPARSE_HEADER_SIZE);
+
+    if (len == SPARSE_HEADER_SIZE && GET32LE(hdr) == SPARSE_HEADER_MAGIC) {
+        if (ring_simg(ring, hdr)) {
+            /* an error block ends the input */
+            ring_wait(ring)->len = -1;
+            ring_push(ring, 1);
+        }
+    } else if (len < 0) {
+        ring->blk[ring->tail].len = -1;
+        ring_push(ring, 1);
+    } else
+        ring_raw(ring, len);
+
+    return NULL;
+}
+
+/* Starts reading fd, or the len bytes at src, into the ring */
+static int ring_start(struct rkft_ring *ring, int fd, const uint8_t *src,
+                      size_t len, unsigned int nsectors) {
+    int i;
+
+    memset(ring, 0, sizeof(*ring));
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    ring->size = nsectors << 9;
+    if (ring->size < SPARSE_HEADER_SIZE)
+        ring->size = 512 * ((SPARSE_HEADER_SIZE + 511) / 512);
+    for (i = 0; i < RKFT_RING_SIZE; i++)
+        if (!(ring->blk[i].data = malloc(ring->size)))
+            return fail("cannot allocate memory\n");
+
+    ring->fd   = fd;
+    ring->src  = src;
+    ring->src_left = len;
+    ring->path = devpath;
+    if (pthread_create(&ring->thread, NULL, ring_reader, ring))
+        return fail("cannot create reader thread\n");
+    return 0;
+}
+
+/* Stops the reader, which may still be waiting for room in the ring, and
+ * frees the blocks.
+ */
+static void ring_stop(struct rkft_ring *ring) {
+    int i;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->thread, NULL);
+    for (i = 0; i < RKFT_RING_SIZE; i++)
+        free(ring->blk[i].data);
+}
+
+/* Returns the i-th oldest unreleased block, with a len of 0 and no fill
+ * or skip past end-of-file.
+ */
+static struct rkft_block *ring_peek(struct rkft_ring *ring, unsigned int i) {
+    static const struct rkft_block end;
+    struct rkft_block *b = (struct rkft_block *)&end;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count <= i && !ring->eof)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    if (ring->count > i)
+        b = &ring->blk[(ring->head + i) % RKFT_RING_SIZE];
+    pthread_mutex_unlock(&ring->lock);
+
+    return b;
+}
+
+#define ring_next(ring) ring_peek(ring, 0)
+
+/* Sectors covered by a block, limited to size */
+static int block_sectors(const struct rkft_block *b, int size) {
+    int nsectors = b->fill || b->skip ? b->fill + b->skip : (b->len + 511) >> 9;
+
+    return nsectors < size ? nsectors : size;
+}
+
+static void ring_release(struct rkft_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->head = (ring->head + 1) % RKFT_RING_SIZE;
+    ring->count--;
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
 
-    if (libusb_kernel_driver_active(h, 0) == 1) {
-        info("kernel driver active\n");
-        if (!libusb_detach_kernel_driver(h, 0))
-            info("driver detached\n");
+/* Counts the data blocks at the head of the ring that make up the next
+ * window of at most max blocks and stores the number of sectors they cover.
+ */
+static unsigned int ring_window(struct rkft_ring *ring, unsigned int max,
+                                int size, int *nsectors) {
+    unsigned int i;
+    struct rkft_block *b;
+
+    *nsectors = 0;
+    for (i = 0; i < max && *nsectors < size; i++) {
+        b = ring_peek(ring, i);
+        if (b->len <= 0 || b->fill || b->skip)
+            break;
+        *nsectors += block_sectors(b, size - *nsectors);
     }
+    return i;
+}
 
-    if (libusb_claim_interface(h, 0) < 0)
-        fatal("cannot claim interface\n");
-    info("interface claimed\n");
+/* Device jobs
+ *
+ * Each selected device gets a job with its own librkflash context, input
+ * and output files and write ring. With more than one device every job
+ * runs in a thread of its own and messages are prefixed with the device
+ * path; the main thread waits for all of them and reports their status.
+ */
 
-    if (libusb_get_device_descriptor(libusb_get_device(h), &desc) != 0)
-        fatal("cannot get device descriptor\n");
+struct job {
+    rkflash f;
+    char path[32];
+    const char *spec;   /* emulator spec, NULL for USB */
+    int in, out;
+    const char *tag;    /* path to prefix messages with, NULL for one device */
+    struct options opts;
+    struct rkft_ring ring;
+    uint8_t *window;    /* device contents under a window */
+    size_t window_size;
+    struct rkflash_partition parts[RKFLASH_MAX_PARTITIONS];
+    int nparts;         /* -1 until the partition table is loaded */
+    uint32_t crc;       /* of the parameter block it came from */
+    int cached;         /* from the cache, not checked against the CRC */
+    int flash_size;     /* sectors, 0 until known */
+    int ready;          /* bootloader interface initialized */
+    int probed;         /* transfer sizes probed since then */
+    int open;           /* claimed */
+    double seconds[RKFT_MAX_STEPS];
+    int status;
+    pthread_t thread;
+    pthread_mutex_t lock;       /* requests to the daemon take turns */
+    pthread_cond_t turn;
+    unsigned int ticket, serving;
+};
 
-    if (desc.bcdUSB == 0x200)
-        info("MASK ROM MODE\n");
+/* messages of the library, from whichever thread works on the device */
+static void message(rkflash *f, int progress, const char *fmt, va_list ap) {
+    struct job *j = f->user;
 
-    switch(action) {
-    case 'l':
-        info("load DDR init\n");
-        crc16 = 0xffff;
-        while ((nr = read(0, buf, 4096)) == 4096) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1137, buf, nr, 0);
-        }
-        if (nr != -1) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            buf[nr++] = crc16 >> 8;
-            buf[nr++] = crc16 & 0xff;
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1137, buf, nr, 0);
-        }
-        goto exit;
-    case 'L':
-        info("load USB loader\n");
-        crc16 = 0xffff;
-        while ((nr = read(0, buf, 4096)) == 4096) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1138, buf, nr, 0);
-        }
-        if (nr != -1) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            buf[nr++] = crc16 >> 8;
-            buf[nr++] = crc16 & 0xff;
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1138, buf, nr, 0);
-        }
-        goto exit;
+    vmessage(j->tag, 0, progress, fmt, ap);
+}
+
+static int open_file(int *fd, const char *name, int flags) {
+    char path[4096];
+
+    if (devpath)
+        snprintf(path, sizeof(path), flags & O_CREAT ? "%s.%s" : "%s",
+                 name, devpath);
+    else
+        snprintf(path, sizeof(path), "%s", name);
+
+    if ((*fd = open(path, flags | O_BINARY, 0644)) == -1)
+        return fail("%s: %s\n", path, strerror(errno));
+    return 0;
+}
+
+static int read_all(int fd, uint8_t **data, size_t *len) {
+    size_t max = 0x10000;
+    ssize_t nr;
+
+    *len = 0;
+    if (!(*data = malloc(max)))
+        return fail("cannot allocate memory\n");
+    while ((nr = read(fd, *data + *len, max - *len)) > 0) {
+        *len += nr;
+        if (*len == max && !(*data = realloc(*data, max *= 2)))
+            return fail("cannot allocate memory\n");
     }
+    if (nr < 0)
+        return fail("read error: %s\n", strerror(errno));
+    return 0;
+}
 
-    /* Initialize bootloader interface */
+/* Partition table
+ *
+ * The mtdparts of the parameter block are parsed once per run. With -C,
+ * the tables are also kept on the host, in dir/params-<crc> named after
+ * the CRC of the parameter block, so devices with the same parameters
+ * share one. dir/device-<path> records which one a device has, with its
+ * flash ID and size. A device entry is only trusted if the flash ID and
+ * size still match, which takes two small commands instead of reading
+ * the parameter block; before w, e or U change the flash by name, the CRC
+ * of the parameter block is read back as well. P and U forget the device's
+ * entry. The files are written under a temporary name and renamed into
+ * place, so other runs and workers never see half of one.
+ */
 
-    send_cmd(RKFT_CMD_TESTUNITREADY, 0, 0);
-    recv_res();
-    usleep(20*1000);
+static void cache_name(struct job *j, char *name, size_t size, uint32_t crc) {
+    if (crc)
+        snprintf(name, size, "%s/params-%08x", cachedir, crc);
+    else
+        snprintf(name, size, "%s/device-%s", cachedir, j->path);
+}
 
-    /* Parse partition name */
-    if (partname) {
-        info("working with partition: %s\n", partname);
+static FILE *cache_create(struct job *j, const char *name, char *tmp, size_t size) {
+    snprintf(tmp, size, "%s.%ld.%s.tmp", name, (long)getpid(), j->path);
+    return fopen(tmp, "w");
+}
 
-        /* Read parameters */
-        offset = 0;
-        send_cmd(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-        recv_buf(RKFT_BLOCKSIZE);
-        recv_res();
+static void cache_commit(FILE *fp, const char *tmp, const char *name) {
+    int bad = ferror(fp);
 
-        /* Check parameter length */
-        uint32_t *p = (uint32_t*)buf+1;
-        size = *p;
-        if (size < 0 || size > MAX_PARAM_LENGTH)
-          fatal("Bad parameter length!\n");
+    if (fclose(fp) || bad)
+        unlink(tmp);
+#ifdef _WIN32
+    else if (unlink(name), rename(tmp, name))   /* no replacing rename */
+#else
+    else if (rename(tmp, name))
+#endif
+        unlink(tmp);
+}
 
-        /* Search for mtdparts */
-        const char *param = (const char *)&buf[8];
-        const char *mtdparts = strstr(param, "mtdparts=");
-        if (!mtdparts) {
-            info("Error: 'mtdparts' not found in command line.\n");
-            goto exit;
-        }
+static void flash_id_string(const uint8_t *id, char *buf) {
+    sprintf(buf, "%02x%02x%02x%02x%02x", id[0], id[1], id[2], id[3], id[4]);
+}
 
-        /* Search for '(partition_name)' */
-        char partexp[256];
-        snprintf(partexp, 256, "(%s)", partname);
-        char *par = strstr(mtdparts, partexp);
-        if (!par) {
-            info("Error: Partition '%s' not found.\n", partname);
-            goto exit;
-        }
+static int read_cache(struct job *j) {
+    char name[4096], line[256], pname[64], idstr[11], cached_id[11];
+    struct rkflash_partition *p;
+    nand_info nand;
+    uint8_t id[5];
+    int flash_size;
+    FILE *fp;
+
+    cache_name(j, name, sizeof(name), 0);
+    if (!(fp = fopen(name, "r")))
+        return -1;
+    if (fscanf(fp, "%x %d %10s", &j->crc, &flash_size, cached_id) != 3) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    /* another board on the same port? */
+    if (rkflash_flash_id(&j->f, id) || rkflash_flash_info(&j->f, &nand))
+        return -1;
+    flash_id_string(id, idstr);
+    if (strcmp(idstr, cached_id) || (flash_size && (uint32_t)flash_size != nand.flash_size)) {
+        info("cached partition table is for another device\n");
+        return -1;
+    }
+    j->flash_size = nand.flash_size;
+
+    cache_name(j, name, sizeof(name), j->crc);
+    if (!(fp = fopen(name, "r")))
+        return -1;
+    for (j->nparts = 0; j->nparts < RKFLASH_MAX_PARTITIONS &&
+                        fgets(line, sizeof(line), fp); ) {
+        p = &j->parts[j->nparts];
+        if (sscanf(line, "%63s %i %i", pname, &p->offset, &p->size) != 3)
+            continue;
+        strcpy(p->name, strcmp(pname, "-") ? pname : "");
+        j->nparts++;
+    }
+    fclose(fp);
+
+    info("partition table %08x from the cache\n", j->crc);
+    j->cached = 1;
+    return 0;
+}
+
+static void write_device_cache(struct job *j) {
+    char name[4096], tmp[4200], idstr[11];
+    uint8_t id[5];
+    FILE *fp;
+
+    if (rkflash_flash_id(&j->f, id))
+        return;
+    flash_id_string(id, idstr);
+    cache_name(j, name, sizeof(name), 0);
+    if ((fp = cache_create(j, name, tmp, sizeof(tmp)))) {
+        fprintf(fp, "%08x %d %s\n", j->crc, j->flash_size, idstr);
+        cache_commit(fp, tmp, name);
+    }
+}
+
+static void write_cache(struct job *j) {
+    char name[4096], tmp[4200];
+    FILE *fp;
+    int i;
+
+    cache_name(j, name, sizeof(name), j->crc);
+    if ((fp = cache_create(j, name, tmp, sizeof(tmp)))) {
+        for (i = 0; i < j->nparts; i++)
+            fprintf(fp, "%s 0x%08x %d\n", j->parts[i].name[0] ? j->parts[i].name : "-",
+                    j->parts[i].offset, j->parts[i].size);
+        cache_commit(fp, tmp, name);
+    }
+    write_device_cache(j);
+}
+
+/* After the parameters changed */
+static void forget_partitions(struct job *j) {
+    char name[4096];
+
+    j->nparts = -1;
+    if (cachedir) {
+        cache_name(j, name, sizeof(name), 0);
+        unlink(name);
+    }
+}
+
+static int load_partitions(struct job *j) {
+    int r;
+
+    if (j->nparts >= 0 || (cachedir && !read_cache(j)))
+        return 0;
 
-        /* Cut string by NULL-ing just before (partition_name) */
-        par[0] = '\0';
+    if ((r = rkflash_read_partitions(&j->f, j->parts, RKFLASH_MAX_PARTITIONS,
+                                     &j->crc)) < 0)
+        return lib_error(r);
+    j->nparts = r < RKFLASH_MAX_PARTITIONS ? r : RKFLASH_MAX_PARTITIONS;
+    j->cached = 0;
+    if (cachedir)
+        write_cache(j);
+    return 0;
+}
+
+/* Loads the partition table to change the flash by, making sure one from
+ * the cache is still the device's own.
+ */
+static int load_partitions_to_write(struct job *j) {
+    uint8_t buf[RKFT_BLOCKSIZE];
+    uint32_t crc;
+    int len, r;
+
+    if (load_partitions(j))
+        return 1;
+    if (!j->cached)
+        return 0;
+
+    if ((r = rkflash_read_params(&j->f, buf, &len)))
+        return lib_error(r);
+    memcpy(&crc, buf + 8 + len, 4);
+    j->cached = 0;
+    if (crc == j->crc)
+        return 0;
+
+    info("cached partition table %08x is out of date\n", j->crc);
+    buf[8 + len] = '\0';
+    if ((r = rkflash_parse_mtdparts((char *)buf + 8, j->parts,
+                                    RKFLASH_MAX_PARTITIONS)) < 0) {
+        j->nparts = -1;
+        return fail("bad mtdparts in the parameters\n");
+    }
+    j->nparts = r < RKFLASH_MAX_PARTITIONS ? r : RKFLASH_MAX_PARTITIONS;
+    j->crc = crc;
+    write_cache(j);
+    return 0;
+}
 
-        /* Search for '@' sign */
-        char *arob = strrchr(mtdparts, '@');
-        if (!arob) {
-            info("Error: Bad syntax in mtdparts.\n");
-            goto exit;
+/* Resolves the size of a '-' partition, up to the end of the flash */
+static int partition_size(struct job *j, const struct rkflash_partition *p) {
+    nand_info nand;
+    int r;
+
+    if (p->size >= 0)
+        return p->size;
+    if (!j->flash_size) {
+        if ((r = rkflash_flash_info(&j->f, &nand))) {
+            lib_error(r);
+            return -1;
         }
+        j->flash_size = nand.flash_size;
+        if (cachedir)
+            write_device_cache(j);
+    }
+    return j->flash_size - p->offset;
+}
+
+static int find_partition(struct job *j, const char *name, int writing,
+                          int *offset, int *size) {
+    int i;
+
+    if (writing ? load_partitions_to_write(j) : load_partitions(j))
+        return 1;
+    for (i = 0; i < j->nparts && strcmp(j->parts[i].name, name); i++)
+        ;
+    if (i == j->nparts)
+        return fail("partition '%s' not found\n", name);
+
+    *offset = j->parts[i].offset;
+    info("found offset: %#010x\n", *offset);
+    if ((*size = partition_size(j, &j->parts[i])) < 0)
+        return 1;
+    if (j->parts[i].size < 0)
+        info("partition extends up to the end of NAND (size: 0x%08x).\n", *size);
+    else
+        info("found size: %#010x\n", *size);
+    return 0;
+}
 
-        offset = strtoul(arob+1, NULL, 0);
-        info("found offset: %#010x\n", offset);
+static int write_out(void *user, int offset, uint8_t *data, int nsectors) {
+    struct job *j = user;
 
-        /* Cut string by NULL-ing just before '@' sign */
-        arob[0] = '\0';
+    infocr("reading flash memory at offset 0x%08x", offset);
 
-        /* Search for '-' sign (if last partition) */
-        char *minus = strrchr(mtdparts, '-');
-        if (minus) {
+    return write(j->out, data, nsectors << 9) <= 0;
+}
+
+/* Writes the blocks of the ring to size sectors at offset */
+static int write_blocks(struct job *j, int offset, int size) {
+    rkflash *f = &j->f;
+    struct rkft_ring *ring = &j->ring;
+    const struct options *o = &j->opts;
+    int r;
 
-            /* Read size from NAND info */
-            send_cmd(RKFT_CMD_READFLASHINFO, 0, 0);
-            recv_buf(512);
-            recv_res();
+    while (size > 0) {
+        struct rkft_block *b = ring_next(ring);
+        unsigned int i, count;
+        int nsectors = block_sectors(b, size), pos;
 
-            nand_info *nand = (nand_info *) buf;
-            size = nand->flash_size - offset;
+        infocr("writing flash memory at offset 0x%08x", offset);
+
+        if (b->len < 0)
+            return fail("%s\n", ring->error);
+        if (nsectors == 0)
+            break;
 
-            info("partition extends up to the end of NAND (size: 0x%08x).\n", size);
-            goto action;
+        if (b->fill || b->skip) {
+            if (b->fill) {
+                if ((r = rkflash_fill(f, offset, nsectors)))
+                    return lib_error(r);
+            } else {
+                f->sparse_saved += (long long)nsectors << 9;
+            }
+            ring_release(ring);
+            offset += nsectors;
+            size   -= nsectors;
+            continue;
         }
 
-        /* Search for ',' sign */
-        char *comma = strrchr(mtdparts, ',');
-        if (comma) {
-            size = strtoul(comma+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
+        /* a window of data blocks, just one without delta or verify */
+        count = ring_window(ring, o->delta || o->verify ? RKFT_WINDOW : 1,
+                            size, &nsectors);
+        if (o->delta && (r = rkflash_read_lba(f, offset, nsectors, j->window)))
+            return lib_error(r);
+
+        for (i = 0, pos = 0; i < count; i++) {
+            int n;
+
+            b = ring_peek(ring, i);
+            n = block_sectors(b, nsectors - pos);
+            if (i)
+                infocr("writing flash memory at offset 0x%08x", offset + pos);
+            if (b->len < n << 9)
+                memset(b->data + b->len, 0xff, (n << 9) - b->len);
+            if ((r = rkflash_write(f, offset + pos, n, b->data,
+                                   o->delta ? j->window + (pos << 9) : NULL)))
+                return lib_error(r);
+            pos += n;
         }
 
-        /* Search for ':' sign (if first partition) */
-        char *colon = strrchr(mtdparts, ':');
-        if (colon) {
-            size = strtoul(colon+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
+        if (o->verify) {
+            if ((r = rkflash_flush(f)) ||
+                (r = rkflash_read_lba(f, offset, nsectors, j->window)))
+                return lib_error(r);
+            for (i = 0, pos = 0; i < count; i++) {
+                int n;
+
+                b = ring_peek(ring, i);
+                n = block_sectors(b, nsectors - pos);
+                if ((r = rkflash_check(f, offset + pos, n, b->data,
+                                       j->window + (pos << 9))))
+                    return lib_error(r);
+                pos += n;
+            }
+            if ((r = rkflash_fixup(f)) < 0)
+                return lib_error(r);
         }
 
-        /* Error: size not found! */
-        info("Error: Bad syntax for partition size.\n");
-        goto exit;
+        while (count--)
+            ring_release(ring);
+        offset += nsectors;
+        size   -= nsectors;
     }
+    if ((r = rkflash_flush(f)))
+        return lib_error(r);
+    done();
+    if (size > 0 && !ring->src)
+        info("premature end-of-file reached.\n");
+    if (f->sparse_saved)
+        info("sparse: %lld bytes not transferred\n", f->sparse_saved);
+    if (o->delta)
+        info("delta: %lld of %lld bytes changed\n", f->delta_changed,
+             f->delta_total);
+    return 0;
+}
 
-action:
-    /* Check and execute command */
+/* Writes the input, or the len bytes at src, to size sectors at offset */
+static int write_flash(struct job *j, int offset, int size,
+                       const uint8_t *src, size_t len) {
+    rkflash *f = &j->f;
+    unsigned int max = f->xfer_size > RKFT_OFF_INCR ? f->xfer_size : RKFT_OFF_INCR;
+    size_t wsize = (size_t)(RKFT_WINDOW * max) << 9;
+    int r;
+
+    /* t in an earlier step may have raised the transfer size */
+    if ((j->opts.delta || j->opts.verify) && j->window_size < wsize) {
+        free(j->window);
+        if (!(j->window = malloc(wsize)))
+            return fail("cannot allocate memory\n");
+        j->window_size = wsize;
+    }
+    if (ring_start(&j->ring, j->in, src, len, f->xfer_size))
+        return 1;
+    r = write_blocks(j, offset, size);
+    ring_stop(&j->ring);
+    return r;
+}
 
-    switch(action) {
-    case 'b':   /* Reboot device */
-        info("rebooting device...\n");
-        send_reset(flag);
-        recv_res();
-        break;
-    case 'r':   /* Read FLASH */
-        while (size > 0) {
-            infocr("reading flash memory at offset 0x%08x", offset);
+/* Flashing an update.img
+ *
+ * The RKAF image, or the one embedded in an RKFW image, is mapped rather
+ * than unpacked. Its parameter entry is written first and its mtdparts
+ * place the other entries, which are then written straight from the
+ * mapping in flash order, all on the one open device. Entries without a
+ * partition, like the bootloader, are skipped.
+ */
+
+#define RKAF_MAX_ENTRIES    16
+
+struct update_entry {
+    char name[33];
+    const uint8_t *data;
+    uint32_t len;
+    int offset, size;
+};
 
-            send_cmd(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-            recv_buf(RKFT_BLOCKSIZE);
-            recv_res();
+static int cmp_update_entry(const void *a, const void *b) {
+    const struct update_entry *x = a, *y = b;
 
-            if (write(1, buf, RKFT_BLOCKSIZE) <= 0)
-                fatal("Write error! Disk full?\n");
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
 
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
+/* Checks the RKAF image at img and everything in it against the partition
+ * table it brings, or the one on the device, before anything is written.
+ * Then writes the parameters and the partitions, in flash order.
+ */
+static int update_image(struct job *j, const uint8_t *map, off_t size) {
+    rkflash *f = &j->f;
+    struct update_entry entries[RKAF_MAX_ENTRIES], *u;
+    struct rkflash_partition parts[RKFLASH_MAX_PARTITIONS];
+    char params[RKFT_BLOCKSIZE];
+    const uint8_t *img, *e, *param = NULL;
+    uint32_t pos, len, count, base = 0;
+    int i, k, n = 0, nparts, plen = 0, r;
+
+    if (!memcmp(map, "RKFW", 4))
+        base = GET32LE(map + 0x21);
+    if (base > size - 0x800 || memcmp(map + base, "RKAF", 4))
+        return fail("no RKAF image found\n");
+    img = map + base;
+
+    if ((count = GET32LE(img + 0x88)) > RKAF_MAX_ENTRIES)
+        return fail("invalid number of files\n");
+
+    for (i = 0; i < (int)count; i++) {
+        e   = img + 0x8c + i * 0x70;
+        pos = GET32LE(e + 0x60);
+        len = GET32LE(e + 0x6c);
+        if (!memcmp(e + 0x20, "SELF", 4) || !memcmp(e + 0x20, "RESERVED", 8))
+            continue;
+        if (pos > size - base || len > size - base - pos)
+            return fail("%.32s: beyond end of file\n", e);
+
+        if (!memcmp(e, "parameter", 10)) {
+            if (len < 12 || memcmp(img + pos, "PARM", 4) ||
+                GET32LE(img + pos + 4) > len - 12)
+                return fail("bad parameter entry\n");
+            param = img + pos;
+            continue;
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'w':   /* Write FLASH */
-        while (size > 0) {
-            infocr("writing flash memory at offset 0x%08x", offset);
 
-            if (read(0, buf, RKFT_BLOCKSIZE) <= 0) {
-                fprintf(stderr, "... Done!\n");
-                info("premature end-of-file reached.\n");
-                goto exit;
-            }
+        u = &entries[n++];
+        snprintf(u->name, sizeof(u->name), "%.32s", (const char *)e);
+        u->data = img + pos;
+        u->len  = len;
+    }
 
-            send_cmd(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-            send_buf(RKFT_BLOCKSIZE);
-            recv_res();
+    /* the image's own partition table, or else the one on the device */
+    if (param) {
+        plen = GET32LE(param + 4);
+        if (plen > (int)sizeof(params) - 1)
+            return fail("bad parameter entry\n");
+        memcpy(params, param + 8, plen);
+        params[plen] = '\0';
+        if ((r = rkflash_parse_mtdparts(params, parts, RKFLASH_MAX_PARTITIONS)) < 0)
+            return fail("bad mtdparts in the parameter entry\n");
+        nparts = r < RKFLASH_MAX_PARTITIONS ? r : RKFLASH_MAX_PARTITIONS;
+    } else {
+        info("no parameter entry, using the partitions on the device\n");
+        if (load_partitions_to_write(j))
+            return 1;
+        nparts = j->nparts;
+        memcpy(parts, j->parts, nparts * sizeof(*parts));
+    }
 
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
+    for (i = 0; i < n; i++) {
+        u = &entries[i];
+        for (k = 0; k < nparts && strcmp(parts[k].name, u->name); k++)
+            ;
+        if (k == nparts) {
+            info("%s: no partition, skipped\n", u->name);
+            u->offset = -1;
+            continue;
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'p':   /* Retrieve parameters */
-        {
-            uint32_t *p = (uint32_t*)buf+1;
+        u->offset = parts[k].offset;
+        if ((u->size = partition_size(j, &parts[k])) < 0)
+            return 1;
+        if (u->len >= SPARSE_HEADER_SIZE && GET32LE(u->data) == SPARSE_HEADER_MAGIC)
+            len = ((uint64_t)GET32LE(u->data + 16) * GET32LE(u->data + 12)) >> 9;
+        else
+            len = (u->len + 511) >> 9;
+        if (len > (uint32_t)u->size)
+            return fail("%s: %u sectors do not fit in the partition (%d sectors)\n",
+                        u->name, len, u->size);
+    }
 
-            info("reading parameters at offset 0x%08x\n", offset);
+    /* all is well, change the partition table */
+    if (param) {
+        info("writing parameters (%d bytes)\n", plen);
+        r = rkflash_write_params(f, param + 8, plen, j->opts.verify);
+        forget_partitions(j);
+        if (r < 0)
+            return lib_error(r);
+        done();
+        memcpy(j->parts, parts, nparts * sizeof(*parts));
+        j->nparts = nparts;
+        j->cached = 0;
+    }
 
-            send_cmd(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-            recv_buf(RKFT_BLOCKSIZE);
-            recv_res();
+    qsort(entries, n, sizeof(*entries), cmp_update_entry);
 
-            /* Check size */
-            size = *p;
-            info("size:  0x%08x\n", size);
-            if (size < 0 || size > MAX_PARAM_LENGTH)
-                fatal("Bad parameter length!\n");
+    for (i = 0; i < n; i++) {
+        u = &entries[i];
+        if (u->offset < 0)
+            continue;
+        info("writing %s (%u bytes) at 0x%08x\n", u->name, u->len, u->offset);
+        if (write_flash(j, u->offset, u->size, u->data, u->len))
+            return 1;
+    }
+    return 0;
+}
 
-            /* Check CRC */
-            uint32_t crc_buf = *(uint32_t *)(buf + 8 + size),
-                     crc = 0;
-            crc = rkcrc32(crc, buf + 8, size);
-            if (crc_buf != crc)
-              fatal("bad CRC! (%#x, should be %#x)\n", crc_buf, crc);
+static int flash_update(struct job *j) {
+    const uint8_t *map;
+    struct stat st;
+    int r;
 
-            if (write(1, &buf[8], size) <= 0)
-                fatal("Write error! Disk full?\n");
-        }
-        break;
-    case 'P':   /* Write parameters */
-        {
-            /* Header */
-            strncpy((char *)buf, "PARM", 4);
+    if (fstat(j->in, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < 0x800 ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, j->in, 0)) == MAP_FAILED)
+        return fail("update.img must be a regular file\n");
+#ifdef MADV_SEQUENTIAL
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+#endif
 
-            /* Content */
-            int sizeRead;
-            if ((sizeRead = read(0, buf + 8, RKFT_BLOCKSIZE - 8)) < 0) {
-                info("read error: %s\n", strerror(errno));
-                goto exit;
-            }
+    r = update_image(j, map, st.st_size);
+    munmap((void *)map, st.st_size);
+    return r;
+}
+
+/* Runs the action of a step on the open device */
+static int act(struct job *j, const struct step *s) {
+    rkflash *f = &j->f;
+    uint8_t buf[RKFT_IDB_BLOCKSIZE * RKFT_IDB_INCR];   /* > RKFT_BLOCKSIZE */
+    int offset = s->offset, size = s->size;
+    uint8_t *data;
+    size_t len;
+    ssize_t nr;
+    nand_info nand;
+    int r;
 
-            /* Length */
-            *(uint32_t *)(buf + 4) = sizeRead;
+    switch(s->action) {
+    case 'l':
+    case 'L':
+        info(s->action == 'l' ? "load DDR init\n" : "load USB loader\n");
+        if (read_all(j->in, &data, &len))
+            return 1;
+        r = rkflash_load(f, s->action == 'l' ? RKFLASH_LOAD_DDR : RKFLASH_LOAD_USB,
+                         data, len);
+        free(data);
+        return r ? lib_error(r) : 0;
+    }
+
+    /* Initialize bootloader interface, once per session */
 
-            /* CRC */
-            uint32_t crc = 0;
-            crc = rkcrc32(crc, buf + 8, sizeRead);
-            PUT32LE(buf + 8 + sizeRead, crc);
+    if (!j->ready) {
+        if ((r = rkflash_ready(f)))
+            return lib_error(r);
+        j->ready  = 1;
+        j->probed = 0;
+    }
+
+    /* options are per step, the daemon gets them with every request; a
+     * probe in an earlier step wins over -s */
+    if (j->opts.xfer_size && !j->probed)
+        f->xfer_size = j->opts.xfer_size;
+    if (s->action == 't' || (j->opts.probe && !j->probed)) {
+        j->probed = 1;
+        if ((r = rkflash_probe(f)) < 0)
+            return lib_error(r);
+    }
+    f->sparse = j->opts.sparse;
+    f->verify_retries = j->opts.verify_retries;
 
-            /*
-             * The parameter file is written at 8 different offsets:
-             * 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00
-             */
+    /* statistics are per step */
+    f->sparse_saved = f->delta_total = f->delta_changed = 0;
+    f->verify_total = f->verify_bad = 0;
 
-            for(offset = 0; offset < 0x2000; offset += 0x400) {
-                infocr("writing flash memory at offset 0x%08x", offset);
-                send_cmd(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-                send_buf(RKFT_BLOCKSIZE);
-                recv_res();
-            }
+    /* Parse partition name */
+    if (s->partname) {
+        info("working with partition: %s\n", s->partname);
+        if (find_partition(j, s->partname, s->action != 'r', &offset, &size))
+            return 1;
+    }
+
+    /* Check and execute command */
+
+    switch(s->action) {
+    case 'b':   /* Reboot device */
+        info("rebooting device...\n");
+        if ((r = rkflash_reset(f, s->flag)))
+            return lib_error(r);
+        break;
+    case 'r':   /* Read FLASH */
+        r = rkflash_read(f, offset, size, write_out, j);
+        if (r == RKFLASH_EABORT)
+            return fail("Write error! Disk full?\n");
+        if (r)
+            return lib_error(r);
+        done();
+        break;
+    case 'w':   /* Write FLASH */
+        if (write_flash(j, offset, size, NULL, 0))
+            return 1;
+        break;
+    case 'U':   /* Flash update.img */
+        if (flash_update(j))
+            return 1;
+        break;
+    case 'p':   /* Retrieve parameters */
+        info("reading parameters at offset 0x%08x\n", 0);
+
+        if ((r = rkflash_read_params(f, buf, &size)))
+            return lib_error(r);
+        info("size:  0x%08x\n", size);
+
+        if (write(j->out, &buf[8], size) <= 0)
+            return fail("Write error! Disk full?\n");
+        break;
+    case 'P':   /* Write parameters */
+        for (len = 0; len < RKFT_BLOCKSIZE - 12; len += nr)
+            if ((nr = read(j->in, buf + len, RKFT_BLOCKSIZE - 12 - len)) <= 0)
+                break;
+        if (nr < 0)
+            return fail("read error: %s\n", strerror(errno));
+
+        r = rkflash_write_params(f, buf, len, j->opts.verify);
+        forget_partitions(j);
+        if (r < 0)
+            return lib_error(r);
+        done();
+        break;
+    case 'T':   /* List partitions */
+        if (load_partitions(j))
+            return 1;
+        for (r = 0; r < j->nparts; r++) {
+            if ((size = partition_size(j, &j->parts[r])) < 0)
+                return 1;
+            len = snprintf((char *)buf, sizeof(buf), "0x%08x 0x%08x %s%s\n",
+                           j->parts[r].offset, size, j->parts[r].name,
+                           j->parts[r].size < 0 ? " (-)" : "");
+            if (write(j->out, buf, len) <= 0)
+                return fail("Write error! Disk full?\n");
         }
-        fprintf(stderr, "... Done!\n");
         break;
     case 'm':   /* Read RAM */
         while (size > 0) {
             int sizeRead = size > RKFT_BLOCKSIZE ? RKFT_BLOCKSIZE : size;
             infocr("reading memory at offset 0x%08x size %x", offset, sizeRead);
 
-            send_cmd(RKFT_CMD_READSDRAM, offset - SDRAM_BASE_ADDRESS, sizeRead);
-            recv_buf(sizeRead);
-            recv_res();
+            if ((r = rkflash_read_sdram(f, offset, buf, sizeRead)))
+                return lib_error(r);
 
-            if (write(1, buf, sizeRead) <= 0)
-                fatal("Write error! Disk full?\n");
+            if (write(j->out, buf, sizeRead) <= 0)
+                return fail("Write error! Disk full?\n");
 
             offset += sizeRead;
             size -= sizeRead;
         }
-        fprintf(stderr, "... Done!\n");
+        done();
         break;
     case 'M':   /* Write RAM */
         while (size > 0) {
             int sizeRead;
-            if ((sizeRead = read(0, buf, RKFT_BLOCKSIZE)) <= 0) {
+            if ((sizeRead = read(j->in, buf, RKFT_BLOCKSIZE)) <= 0) {
                 info("premature end-of-file reached.\n");
-                goto exit;
+                return 0;
             }
             infocr("writing memory at offset 0x%08x size %x", offset, sizeRead);
 
-            send_cmd(RKFT_CMD_WRITESDRAM, offset - SDRAM_BASE_ADDRESS, sizeRead);
-            send_buf(sizeRead);
-            recv_res();
+            if ((r = rkflash_write_sdram(f, offset, buf, sizeRead)))
+                return lib_error(r);
 
             offset += sizeRead;
             size -= sizeRead;
         }
-        fprintf(stderr, "... Done!\n");
+        done();
         break;
     case 'B':   /* Exec RAM */
         info("booting kernel...\n");
-        send_exec(offset - SDRAM_BASE_ADDRESS, size - SDRAM_BASE_ADDRESS);
-        recv_res();
+        if ((r = rkflash_exec(f, offset, size)))
+            return lib_error(r);
         break;
     case 'i':   /* Read IDB */
         while (size > 0) {
             int sizeRead = size > RKFT_IDB_INCR ? RKFT_IDB_INCR : size;
             infocr("reading IDB flash memory at offset 0x%08x", offset);
 
-            send_cmd(RKFT_CMD_READSECTOR, offset, sizeRead);
-            recv_buf(RKFT_IDB_BLOCKSIZE * sizeRead);
-            recv_res();
+            if ((r = rkflash_read_idb(f, offset, sizeRead, buf)))
+                return lib_error(r);
 
-            if (write(1, buf, RKFT_IDB_BLOCKSIZE * sizeRead) <= 0)
-                fatal("Write error! Disk full?\n");
+            if (write(j->out, buf, RKFT_IDB_BLOCKSIZE * sizeRead) <= 0)
+                return fail("Write error! Disk full?\n");
 
             offset += sizeRead;
             size -= sizeRead;
         }
-        fprintf(stderr, "... Done!\n");
+        done();
         break;
     case 'j':   /* write IDB */
         while (size > 0) {
             infocr("writing IDB flash memory at offset 0x%08x", offset);
 
-            memset(ibuf, RKFT_IDB_BLOCKSIZE, 0xff);
-            if (read(0, ibuf, RKFT_IDB_DATASIZE) <= 0) {
-                fprintf(stderr, "... Done!\n");
+            if ((nr = read(j->in, buf, RKFT_IDB_DATASIZE)) <= 0) {
+                done();
                 info("premature end-of-file reached.\n");
-                goto exit;
+                return 0;
             }
 
-            send_cmd(RKFT_CMD_WRITESECTOR, offset, 1);
-            libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, ibuf, RKFT_IDB_BLOCKSIZE, &tmp, 0);
-            recv_res();
+            if ((r = rkflash_write_idb(f, offset, buf, nr)))
+                return lib_error(r);
             offset += 1;
             size -= 1;
         }
-        fprintf(stderr, "... Done!\n");
+        done();
         break;
     case 'e':   /* Erase flash */
-        memset(buf, 0xff, RKFT_BLOCKSIZE);
-        while (size > 0) {
-            infocr("erasing flash memory at offset 0x%08x", offset);
-
-            send_cmd(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-            send_buf(RKFT_BLOCKSIZE);
-            recv_res();
-
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
-        }
-        fprintf(stderr, "... Done!\n");
+        if ((r = rkflash_erase(f, offset, size)) < 0)
+            return lib_error(r);
+        done();
         break;
     case 'v':   /* Read Chip Version */
-        send_cmd(RKFT_CMD_READCHIPINFO, 0, 0);
-        recv_buf(16);
-        recv_res();
+        if ((r = rkflash_chip_info(f, buf)))
+            return lib_error(r);
 
         info("chip version: %c%c%c%c-%c%c%c%c.%c%c.%c%c-%c%c%c%c\n",
             buf[ 3], buf[ 2], buf[ 1], buf[ 0],
@@ -668,20 +1426,17 @@ action:
         break;
     case 'n':   /* Read NAND Flash Info */
     {
-        send_cmd(RKFT_CMD_READFLASHID, 0, 0);
-        recv_buf(5);
-        recv_res();
+        if ((r = rkflash_flash_id(f, buf)))
+            return lib_error(r);
 
         info("Flash ID: %02x %02x %02x %02x %02x\n",
             buf[0], buf[1], buf[2], buf[3], buf[4]);
 
-        send_cmd(RKFT_CMD_READFLASHINFO, 0, 0);
-        recv_buf(512);
-        recv_res();
+        if ((r = rkflash_flash_info(f, &nand)))
+            return lib_error(r);
 
-        nand_info *nand = (nand_info *) buf;
-        uint8_t id = nand->manufacturer_id,
-                cs = nand->chip_select;
+        uint8_t id = nand.manufacturer_id,
+                cs = nand.chip_select;
 
         info("Flash Info:\n"
              "\tManufacturer: %s (%d)\n"
@@ -696,11 +1451,11 @@ action:
              id < MAX_NAND_ID ? manufacturer[id] : "Unknown",
              id,
 
-             nand->flash_size >> 11, /* Flash Size */
-             nand->block_size >> 1,  /* Block Size */
-             nand->page_size  >> 1,  /* Page Size */
-             nand->ecc_bits,         /* ECC Bits */
-             nand->access_time,      /* Access Time */
+             nand.flash_size >> 11, /* Flash Size */
+             nand.block_size >> 1,  /* Block Size */
+             nand.page_size  >> 1,  /* Page Size */
+             nand.ecc_bits,         /* ECC Bits */
+             nand.access_time,      /* Access Time */
 
              /* Flash CS */
              cs & 1 ? " <0>" : "",
@@ -712,11 +1467,1159 @@ action:
         break;
     }
 
-exit:
+    if (f->verify_bad)
+        return fail("verify failed: %lld of %lld bytes differ\n",
+                    f->verify_bad, f->verify_total);
+    if (f->verify_total)
+        info("verified %lld bytes\n", f->verify_total);
+    return 0;
+}
+
+static double elapsed(const struct timespec *t0) {
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Reports the time of every step; failed is nsteps when none failed */
+static void summary(const double *seconds, int failed) {
+    double total = 0;
+    int i;
+
+    for (i = 0; i < nsteps; i++) {
+        if (i > failed) {
+            info("step %2d    skipped  %s\n", i + 1, steps[i].text);
+            continue;
+        }
+        info("step %2d %9.3fs  %s%s\n", i + 1, seconds[i],
+             steps[i].text, i == failed ? "  FAILED" : "");
+        total += seconds[i];
+    }
+    info("%d of %d steps done in %.3fs\n", failed, nsteps, total);
+}
+
+/* Opens the device of a job, unless it is open already */
+static int claim(struct job *j) {
+    int r;
+
+    if (j->open)
+        return 0;
+    j->f.message = message;
+    j->f.user    = j;
+    j->nparts    = -1;
+    j->ready     = 0;
+    if ((r = j->spec ? rkflash_open_emulator(&j->f, j->spec, j->path)
+                     : rkflash_open(&j->f, j->path)))
+        return lib_error(r);
+    info("Detected %s at %s...\n", j->f.name, j->f.path);
+    info("interface claimed\n");
+    if (j->f.maskrom)
+        info("MASK ROM MODE\n");
+    j->open = 1;
+    return 0;
+}
+
+static void release(struct job *j) {
+    rkflash_close(&j->f);
+    j->open = 0;
+}
+
+static int run(struct job *j) {
+    struct timespec t0;
+    int in = 0, out = 1, i, r = 0;
+
+    if ((infile  && open_file(&in, infile, O_RDONLY)) ||
+        (outfile && open_file(&out, outfile, O_WRONLY | O_CREAT | O_TRUNC)) ||
+        claim(j))
+        return 1;
+
+    /* Run the steps until one fails */
+
+    for (i = 0; i < nsteps && !r; i++) {
+        const struct step *s = &steps[i];
+
+        if (nsteps > 1)
+            info("step %d: %s\n", i + 1, s->text);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        j->in  = in;
+        j->out = out;
+        r = (s->infile  && open_file(&j->in, s->infile, O_RDONLY)) ||
+            (s->outfile && open_file(&j->out, s->outfile,
+                                     O_WRONLY | O_CREAT | O_TRUNC)) ||
+            act(j, s);
+        if (j->in != in && j->in != -1)
+            close(j->in);
+        if (j->out != out && j->out != -1)
+            close(j->out);
+        j->seconds[i] = elapsed(&t0);
+    }
+
     /* Disconnect and close all interfaces */
 
-    libusb_release_interface(h, 0);
-    libusb_close(h);
-    libusb_exit(c);
+    release(j);
+    if (infile)  close(in);
+    if (outfile) close(out);
+    if (nsteps > 1)
+        summary(j->seconds, r ? i - 1 : nsteps);
+    return r;
+}
+
+static void *worker(void *arg) {
+    struct job *j = arg;
+
+    devpath = j->tag = j->path;
+    j->status = run(j);
+    return NULL;
+}
+
+static void run_parallel(struct job *jobs, int njobs) {
+    int i, failed = 0;
+
+    info("working on %d devices\n", njobs);
+
+    for (i = 0; i < njobs; i++)
+        if (pthread_create(&jobs[i].thread, NULL, worker, &jobs[i]))
+            fatal("cannot create worker thread\n");
+
+    for (i = 0; i < njobs; i++)
+        pthread_join(jobs[i].thread, NULL);
+
+    for (i = 0; i < njobs; i++) {
+        if (!jobs[i].status) {
+            info("%s: done\n", jobs[i].path);
+        } else {
+            info("%s: FAILED\n", jobs[i].path);
+            failed++;
+        }
+    }
+
+    if (failed)
+        fatal("%d of %d devices failed\n", failed, njobs);
+}
+
+#define NEXT do { argc--;argv++; } while(0)
+
+/* Sets one of the options -s, -S, -E, -D, -R and -V, as on the command
+ * line or in a request to the daemon. Returns non-zero for others.
+ */
+static int set_option(struct options *o, int ch, const char *arg) {
+    unsigned long n;
+
+    switch (ch) {
+    case 's':
+        if (!strcmp(arg, "auto")) {
+            o->probe = 1;
+            break;
+        }
+        n = strtoul(arg, NULL, 0);
+        if (n < 1 || n > 0xffff)
+            return fail("transfer size must be 1..65535 sectors\n");
+        o->xfer_size = n;
+        break;
+    case 'S':
+        o->sparse = RKFLASH_SPARSE_ERASE;
+        break;
+    case 'E':
+        o->sparse = RKFLASH_SPARSE_SKIP;
+        break;
+    case 'D':
+        o->delta = 1;
+        break;
+    case 'R':
+        o->verify_retries = strtoul(arg, NULL, 0);
+        /* fall through */
+    case 'V':
+        o->verify = 1;
+        break;
+    default:
+        return 1;
+    }
+    return 0;
+}
+
+/* Parses an action with its arguments and any <file and >file into s */
+static int parse_step(int argc, char **argv, struct step *s) {
+    char *args[4];
+    size_t len = 0;
+    int i, n = 0;
+
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < argc && len < sizeof(s->text); i++)
+        len += snprintf(s->text + len, sizeof(s->text) - len, "%s%s",
+                        i ? " " : "", argv[i]);
+
+    for (i = 0; i < argc; i++) {
+        char **file = *argv[i] == '<' ? &s->infile :
+                      *argv[i] == '>' ? &s->outfile : NULL;
+
+        if (file) {
+            /* both <file and < file */
+            *file = argv[i] + 1;
+            if (!**file) {
+                if (++i == argc)
+                    return 1;
+                *file = argv[i];
+            }
+        } else if (n == 4) {
+            return 1;
+        } else {
+            args[n++] = argv[i];
+        }
+    }
+    if (!n)
+        return 1;
+
+    s->action = *args[0];
+    argc = n - 1;
+    argv = args + 1;
+
+    switch(s->action) {
+    case 'b':
+        if (argc > 1) return 1;
+        else if (argc == 1)
+            s->flag = strtoul(argv[0], NULL, 0);
+        break;
+    case 'l':
+    case 'L':
+        if (argc) return 1;
+        break;
+    case 'e':
+    case 'r':
+    case 'w':
+        if (argc < 1 || argc > 2) return 1;
+        if (argc == 1) {
+            s->partname = argv[0];
+        } else {
+            s->offset = strtoul(argv[0], NULL, 0);
+            s->size   = strtoul(argv[1], NULL, 0);
+        }
+        break;
+    case 'm':
+    case 'M':
+    case 'B':
+    case 'i':
+    case 'j':
+        if (argc != 2) return 1;
+        s->offset = strtoul(argv[0], NULL, 0);
+        s->size   = strtoul(argv[1], NULL, 0);
+        break;
+    case 'n':
+    case 'v':
+    case 'p':
+    case 'P':
+    case 'U':
+    case 'T':
+    case 't':
+        if (argc) return 1;
+        break;
+    default:
+        return 1;
+    }
+    return 0;
+}
+
+/* Splits a line of a script or a request into at most max words, up to
+ * a #. Returns the number of words or -1 if there are more.
+ */
+static int split(char *line, char **argv, int max) {
+    char *p;
+    int argc = 0;
+
+    if ((p = strchr(line, '#')))
+        *p = 0;
+    for (p = line; *(p += strspn(p, " \t\r\n")); ) {
+        if (argc == max)
+            return -1;
+        argv[argc++] = p;
+        p += strcspn(p, " \t\r\n");
+        if (*p)
+            *p++ = 0;
+    }
+    return argc;
+}
+
+/* Reads the steps of a batch script, one per line, # starts a comment */
+static void read_script(const char *name) {
+    FILE *fp = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    char line[1024], *argv[8], *p;
+    int argc, n = 0;
+
+    if (!fp)
+        fatal("%s: %s\n", name, strerror(errno));
+
+    while (fgets(line, sizeof(line), fp)) {
+        n++;
+        if (!(p = strdup(line)))
+            fatal("cannot allocate memory\n");
+        if ((argc = split(p, argv, 8)) < 0)
+            fatal("%s:%d: too many arguments\n", name, n);
+        if (!argc)
+            continue;
+        if (nsteps == RKFT_MAX_STEPS)
+            fatal("%s:%d: too many steps\n", name, n);
+        if (parse_step(argc, argv, &steps[nsteps++]))
+            fatal("%s:%d: bad step: %s\n", name, n, steps[nsteps-1].text);
+    }
+    if (ferror(fp))
+        fatal("%s: %s\n", name, strerror(errno));
+    if (fp != stdin)
+        fclose(fp);
+}
+
+#ifndef _WIN32
+
+/* Daemon
+ *
+ * With -l the devices are claimed once and stay claimed while clients send
+ * requests over a Unix socket. A request is a line in the syntax of a
+ * batch script, without <file or >file, that may start with @path to pick
+ * the device; "devices" lists them. The descriptor for the input or the
+ * output of the action can be passed along with the line (SCM_RIGHTS).
+ * Without one the data goes over the connection itself, in frames of a
+ * line "data n" from the client or {"data":n} from the daemon followed by
+ * n bytes, with a frame of length 0 at the end. Every request gets a JSON
+ * status line in return.
+ *
+ * Each connection has a thread of its own. Requests for the same device
+ * take turns in the order they came in, different devices work in
+ * parallel. A device that is gone after b or L, or could not be opened,
+ * is opened again by the next request for it.
+ */
+
+struct conn {
+    int fd;
+    int passed;         /* descriptor that came with the data, or -1 */
+    char buf[4096];
+    size_t pos, len;
+};
+
+/* moves data between a connection, or the descriptor passed over it, and
+ * a pipe during an action */
+struct pump {
+    struct conn *c;
+    int fd;             /* our end of the pipe */
+    int passed;         /* descriptor of the client, or -1 for data frames */
+    int error;          /* connection broken */
+    pthread_t thread;
+};
+
+static struct job *served;
+static int nserved;
+static pthread_mutex_t served_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void serve_job(struct job *j) {
+    j->tag = j->path;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->turn, NULL);
+}
+
+/* Adds devices that were connected after the start, served_lock held */
+static void rescan(void) {
+    static struct rkflash_device devs[RKFT_MAX_DEVICES];
+    int i, k, n;
+
+    if (nemulated || (n = rkflash_list(devs, RKFT_MAX_DEVICES)) < 0)
+        return;
+    for (i = 0; i < n && i < RKFT_MAX_DEVICES && nserved < RKFT_MAX_DEVICES; i++) {
+        for (k = 0; k < nselected && strcmp(selected[k], devs[i].path); k++)
+            ;
+        if (nselected && k == nselected)
+            continue;
+        for (k = 0; k < nserved && strcmp(served[k].path, devs[i].path); k++)
+            ;
+        if (k == nserved) {
+            strcpy(served[nserved].path, devs[i].path);
+            serve_job(&served[nserved++]);
+        }
+    }
+}
+
+/* Returns the job for path, or the only one if path is NULL */
+static struct job *find_job(const char *path) {
+    struct job *j = NULL;
+    int i, pass;
+
+    pthread_mutex_lock(&served_lock);
+    for (pass = 0; pass < 2 && !j; pass++) {
+        if (pass)
+            rescan();
+        if (!path && nserved == 1)
+            j = &served[0];
+        for (i = 0; path && i < nserved && !j; i++)
+            if (!strcmp(served[i].path, path))
+                j = &served[i];
+    }
+    pthread_mutex_unlock(&served_lock);
+    return j;
+}
+
+static void take_turn(struct job *j) {
+    unsigned int ticket;
+
+    pthread_mutex_lock(&j->lock);
+    ticket = j->ticket++;
+    while (j->serving != ticket)
+        pthread_cond_wait(&j->turn, &j->lock);
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void end_turn(struct job *j) {
+    pthread_mutex_lock(&j->lock);
+    j->serving++;
+    pthread_cond_broadcast(&j->turn);
+    pthread_mutex_unlock(&j->lock);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    ssize_t nw;
+
+    while (len > 0) {
+        if ((nw = write(fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+/* Receives more data and any descriptor that comes with it */
+static ssize_t conn_fill(struct conn *c) {
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    ssize_t n;
+
+    memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+    c->len -= c->pos;
+    c->pos  = 0;
+    if (c->len == sizeof(c->buf))
+        return -1;
+
+    iov.iov_base = c->buf + c->len;
+    iov.iov_len  = sizeof(c->buf) - c->len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    while ((n = recvmsg(c->fd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return -1;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        if (c->passed != -1)
+            close(c->passed);
+        memcpy(&c->passed, CMSG_DATA(cm), sizeof(int));
+    }
+    c->len += n;
+    return n;
+}
+
+static int conn_line(struct conn *c, char *line, size_t size) {
+    char *nl;
+    size_t n;
+
+    while (!(nl = memchr(c->buf + c->pos, '\n', c->len - c->pos)))
+        if (conn_fill(c) < 0)
+            return -1;
+    n = nl - (c->buf + c->pos);
+    if (n >= size)
+        return -1;
+    memcpy(line, c->buf + c->pos, n);
+    line[n] = 0;
+    c->pos += n + 1;
     return 0;
 }
+
+static ssize_t conn_read(struct conn *c, char *data, size_t len) {
+    if (c->pos == c->len && conn_fill(c) < 0)
+        return -1;
+    if (len > c->len - c->pos)
+        len = c->len - c->pos;
+    memcpy(data, c->buf + c->pos, len);
+    c->pos += len;
+    return len;
+}
+
+/* Feeds the data frames of the client to the action */
+static void *pump_in(void *arg) {
+    struct pump *p = arg;
+    char line[64], data[65536];
+    unsigned long n;
+    ssize_t nr;
+
+    while (!conn_line(p->c, line, sizeof(line)) &&
+           sscanf(line, "data %lu", &n) == 1) {
+        if (!n) {
+            close(p->fd);
+            return NULL;
+        }
+        while (n > 0) {
+            if ((nr = conn_read(p->c, data, n < sizeof(data) ? n : sizeof(data))) < 0)
+                break;
+            n -= nr;
+            /* the action may not want all of it, read on to the end */
+            if (p->fd != -1 && write_all(p->fd, data, nr)) {
+                close(p->fd);
+                p->fd = -1;
+            }
+        }
+    }
+    if (p->fd != -1)
+        close(p->fd);
+    p->error = 1;
+    return NULL;
+}
+
+/* Sends the output of the action to the client in data frames */
+static void *pump_out(void *arg) {
+    struct pump *p = arg;
+    char hdr[32], data[65536];
+    ssize_t nr;
+    int n;
+
+    while ((nr = read(p->fd, data, sizeof(data))) != 0) {
+        if (nr < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        n = snprintf(hdr, sizeof(hdr), "{\"data\":%ld}\n", (long)nr);
+        if (!p->error && (write_all(p->c->fd, hdr, n) ||
+                          write_all(p->c->fd, data, nr)))
+            p->error = 1;
+    }
+    if (!p->error && write_all(p->c->fd, "{\"data\":0}\n", 11))
+        p->error = 1;
+    close(p->fd);
+    return NULL;
+}
+
+/* Waits until fd has events, while watching for the client to hang up and
+ * for an error or hangup on other, unless that is -1. Returns non-zero if
+ * fd will not get there.
+ */
+static int pump_wait(struct pump *p, int fd, short events, int other) {
+    struct pollfd pfd[3];
+
+    pfd[0].fd     = fd;
+    pfd[0].events = events;
+    pfd[1].fd     = p->c->fd;
+    pfd[1].events = 0;          /* POLLHUP is always reported */
+    pfd[2].fd     = other;
+    pfd[2].events = 0;
+    for (;;) {
+        if (poll(pfd, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (pfd[1].revents) {
+            p->error = 1;
+            return 1;
+        }
+        if (pfd[0].revents)
+            return !(pfd[0].revents & events);
+        if (pfd[2].revents)
+            return 1;
+    }
+}
+
+/* Feeds the passed descriptor to the action */
+static void *pump_from(void *arg) {
+    struct pump *p = arg;
+    char data[65536];
+    ssize_t nr;
+
+    /* the action may be done before the input is */
+    while (!pump_wait(p, p->passed, POLLIN, p->fd) &&
+           (nr = read(p->passed, data, sizeof(data))) != 0) {
+        if (nr < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (write_all(p->fd, data, nr))
+            break;
+    }
+    close(p->fd);
+    return NULL;
+}
+
+/* Writes the output of the action to the passed descriptor, in pieces
+ * that fit once it polls writable, so a hangup is noticed in between.
+ */
+static void *pump_to(void *arg) {
+    struct pump *p = arg;
+    char data[65536];
+    ssize_t nr, nw, off;
+
+    while ((nr = read(p->fd, data, sizeof(data))) != 0) {
+        if (nr < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (off = 0; off < nr; off += nw) {
+            if (pump_wait(p, p->passed, POLLOUT, -1))
+                goto out;
+            nw = nr - off < PIPE_BUF ? nr - off : PIPE_BUF;
+            if ((nw = write(p->passed, data + off, nw)) < 0) {
+                if (errno != EINTR)
+                    goto out;
+                nw = 0;
+            }
+        }
+    }
+out:
+    /* the action fails on its next write */
+    close(p->fd);
+    return NULL;
+}
+
+static int hung_up(struct conn *c) {
+    struct pollfd pfd;
+
+    pfd.fd     = c->fd;
+    pfd.events = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Stores s as a JSON string, without a trailing newline */
+static void json_string(char *buf, size_t size, const char *s) {
+    size_t n = 0, len = strlen(s);
+
+    if (len && s[len-1] == '\n')
+        len--;
+    buf[n++] = '"';
+    for (; len-- && n < size - 8; s++) {
+        if (*s == '"' || *s == '\\')
+            n += sprintf(buf + n, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            n += sprintf(buf + n, "\\u%04x", *s);
+        else
+            buf[n++] = *s;
+    }
+    strcpy(buf + n, "\"");
+}
+
+static int reply(struct conn *c, int r, double seconds) {
+    char buf[sizeof(lasterror) * 6 + 64], error[sizeof(lasterror) * 6 + 8];
+    int n;
+
+    if (!r) {
+        n = snprintf(buf, sizeof(buf), "{\"status\":\"ok\",\"seconds\":%.3f}\n",
+                     seconds);
+    } else {
+        json_string(error, sizeof(error), lasterror);
+        n = snprintf(buf, sizeof(buf), "{\"status\":\"error\",\"error\":%s,"
+                     "\"seconds\":%.3f}\n", error, seconds);
+    }
+    return write_all(c->fd, buf, n);
+}
+
+static int list_devices(struct conn *c) {
+    char buf[RKFT_MAX_DEVICES * 128 + 64];
+    size_t n;
+    int i;
+
+    pthread_mutex_lock(&served_lock);
+    rescan();
+    n = snprintf(buf, sizeof(buf), "{\"status\":\"ok\",\"devices\":[");
+    for (i = 0; i < nserved; i++) {
+        struct job *j = &served[i];
+
+        n += snprintf(buf + n, sizeof(buf) - n,
+                      "%s{\"path\":\"%s\",\"claimed\":%s,\"maskrom\":%s}",
+                      i ? "," : "", j->path, j->open ? "true" : "false",
+                      j->open && j->f.maskrom ? "true" : "false");
+    }
+    pthread_mutex_unlock(&served_lock);
+    n += snprintf(buf + n, sizeof(buf) - n, "]}\n");
+    return write_all(c->fd, buf, n);
+}
+
+/* Runs the step with the options o on the device of j, with a pipe to a
+ * pump that moves the data from or to the passed descriptor, or in frames
+ * over the connection when there is none. The pump watches for the client
+ * to hang up, so the action cannot block on a descriptor forever.
+ */
+static int serve_step(struct conn *c, struct job *j, const struct step *s,
+                      const struct options *o, int passed) {
+    int reads = !!strchr(inputs, s->action), writes = !!strchr(outputs, s->action);
+    int in = -1, out = -1, fds[2], pumped = 0, r;
+    void *(*pump)(void *);
+    struct timespec t0;
+    double seconds = 0;
+    struct pump p;
+
+    if (!reads && !writes && passed != -1) {
+        close(passed);
+        passed = -1;
+    }
+    p.c      = c;
+    p.passed = passed;
+    p.error  = 0;
+    if (reads || writes) {
+        if (pipe(fds)) {
+            r = fail("cannot create pipe: %s\n", strerror(errno));
+            if (passed != -1)
+                close(passed);
+            return reply(c, r, 0);
+        }
+        p.fd = reads ? fds[1] : fds[0];
+        if (passed == -1)
+            pump = reads ? pump_in : pump_out;
+        else
+            pump = reads ? pump_from : pump_to;
+        if (pthread_create(&p.thread, NULL, pump, &p)) {
+            close(fds[0]);
+            close(fds[1]);
+            if (passed != -1)
+                close(passed);
+            /* the data frames of the client cannot be read any more */
+            return reply(c, fail("cannot create pump thread\n"), 0) ||
+                   (reads && passed == -1);
+        }
+        pumped = 1;
+        if (reads)
+            in = fds[0];
+        else
+            out = fds[1];
+    }
+
+    /* messages of this connection thread are about j until the reply */
+    devpath = j->path;
+    take_turn(j);
+    j->in   = in;
+    j->out  = out;
+    j->opts = *o;
+    if (hung_up(c)) {
+        /* while waiting for its turn, don't flash half of its input */
+        r = fail("client hung up\n");
+    } else if (!(r = claim(j))) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        liberror = 0;
+        r = act(j, s);
+        seconds = elapsed(&t0);
+        /* gone, or unplugged or reset: claim it again on the next request */
+        if (strchr("bL", s->action) ||
+            (r && (liberror == RKFLASH_EUSB || liberror == RKFLASH_ENODEV)))
+            release(j);
+    }
+    end_turn(j);
+
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    if (pumped)
+        pthread_join(p.thread, NULL);
+    if (passed != -1)
+        close(passed);
+    devpath = NULL;
+    return reply(c, r, seconds) || p.error;
+}
+
+/* Handles a request line, returns non-zero to drop the connection */
+static int request(struct conn *c, char *line) {
+    char *words[16], **argv = words, *path = NULL;
+    int argc, passed = c->passed, bad = 0, r;
+    struct options o = options;
+    struct step s;
+    struct job *j;
+
+    c->passed = -1;
+    if ((argc = split(line, argv, 16)) > 0 && *argv[0] == '@') {
+        path = argv[0] + 1;
+        argc--;
+        argv++;
+    }
+    if (argc == 1 && !strcmp(argv[0], "devices")) {
+        if (passed != -1)
+            close(passed);
+        return list_devices(c);
+    }
+
+    /* options of the client, on top of those of the daemon */
+    while (argc > 0 && *argv[0] == '-' && !bad) {
+        int arg = argv[0][1] == 's' || argv[0][1] == 'R';
+
+        if (!argv[0][1] || argv[0][2] || !strchr("sSEDRV", argv[0][1]) ||
+            argc < 1 + arg)
+            bad = 1;
+        else if (set_option(&o, argv[0][1], arg ? argv[1] : NULL))
+            bad = 2;
+        argc -= 1 + arg;
+        argv += 1 + arg;
+    }
+
+    if (bad == 2)
+        r = 1;
+    else if (argc <= 0 || bad || parse_step(argc, argv, &s))
+        r = fail("bad request\n");
+    else if (s.infile || s.outfile)
+        r = fail("pass a descriptor instead of a file name\n");
+    else if (!(j = find_job(path)))
+        r = path ? fail("no device at %s\n", path)
+                 : fail("no device or several, start the request with @path\n");
+    else
+        return serve_step(c, j, &s, &o, passed);
+
+    if (passed != -1)
+        close(passed);
+    return reply(c, r, 0);
+}
+
+static void *conn_thread(void *arg) {
+    struct conn *c = arg;
+    char line[1024];
+
+    while (!conn_line(c, line, sizeof(line)) && !request(c, line))
+        ;
+    if (c->passed != -1)
+        close(c->passed);
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+static void serve(const char *path, struct job *jobs, int njobs) {
+    struct sockaddr_un sa;
+    struct stat st;
+    struct conn *c;
+    pthread_t thread;
+    int fd, i;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    served  = jobs;
+    nserved = njobs;
+    for (i = 0; i < njobs; i++) {
+        serve_job(&jobs[i]);
+        devpath = jobs[i].path;
+        claim(&jobs[i]);
+    }
+    devpath = NULL;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path))
+        fatal("%s: socket name too long\n", path);
+    strcpy(sa.sun_path, path);
+
+    /* a socket left behind by an earlier run */
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+        listen(fd, 16) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+    info("serving %d devices on %s\n", njobs, path);
+
+    for (;;) {
+        if (!(c = malloc(sizeof(*c))))
+            fatal("cannot allocate memory\n");
+        c->passed = -1;
+        c->pos = c->len = 0;
+        while ((c->fd = accept(fd, NULL, NULL)) == -1)
+            if (errno != EINTR && errno != ECONNABORTED)
+                fatal("%s: %s\n", path, strerror(errno));
+        if (pthread_create(&thread, NULL, conn_thread, c))
+            fatal("cannot create connection thread\n");
+        pthread_detach(thread);
+    }
+}
+
+/* Writes the request for a step, for the device given with -d if any */
+static size_t step_request(const struct step *s, char *buf, size_t size) {
+    size_t n = nselected ? snprintf(buf, size, "@%s ", selected[0]) : 0;
+
+    /* the options of the client, which the daemon applies to this step */
+    if (options.xfer_size)
+        n += snprintf(buf + n, size - n, "-s %u ", options.xfer_size);
+    if (options.probe)
+        n += snprintf(buf + n, size - n, "-s auto ");
+    if (options.sparse)
+        n += snprintf(buf + n, size - n, options.sparse == RKFLASH_SPARSE_ERASE
+                                         ? "-S " : "-E ");
+    if (options.delta)
+        n += snprintf(buf + n, size - n, "-D ");
+    if (options.verify_retries)
+        n += snprintf(buf + n, size - n, "-R %d ", options.verify_retries);
+    else if (options.verify)
+        n += snprintf(buf + n, size - n, "-V ");
+
+    if (s->partname)
+        n += snprintf(buf + n, size - n, "%c %s\n", s->action, s->partname);
+    else if (s->action == 'b')
+        n += snprintf(buf + n, size - n, "%c %u\n", s->action, s->flag);
+    else if (strchr("mMBijerw", s->action))
+        n += snprintf(buf + n, size - n, "%c 0x%x 0x%x\n", s->action,
+                      s->offset, s->size);
+    else
+        n += snprintf(buf + n, size - n, "%c\n", s->action);
+    return n;
+}
+
+/* Runs the steps through the daemon, passing it the input or output */
+static int client(const char *path) {
+    struct sockaddr_un sa;
+    char line[1024], ctl[CMSG_SPACE(sizeof(int))], *e;
+    double seconds[RKFT_MAX_STEPS];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int fd, io, opened, i, r = 0;
+    size_t n;
+
+    if (nselected > 1)
+        fatal("only one -d with -c\n");
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path))
+        fatal("%s: socket name too long\n", path);
+    strcpy(sa.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+
+    for (i = 0; i < nsteps && !r; i++) {
+        const struct step *s = &steps[i];
+
+        if (nsteps > 1)
+            info("step %d: %s\n", i + 1, s->text);
+        seconds[i] = 0;
+
+        io = -1;
+        opened = 0;
+        if (strchr(inputs, s->action)) {
+            io = 0;
+            if ((opened = s->infile || infile) &&
+                open_file(&io, s->infile ? s->infile : infile, O_RDONLY)) {
+                r = 1;
+                continue;
+            }
+        } else if (strchr(outputs, s->action)) {
+            io = 1;
+            if ((opened = s->outfile || outfile) &&
+                open_file(&io, s->outfile ? s->outfile : outfile,
+                          O_WRONLY | O_CREAT | O_TRUNC)) {
+                r = 1;
+                continue;
+            }
+        }
+
+        iov.iov_base = line;
+        iov.iov_len  = step_request(s, line, sizeof(line));
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = &iov;
+        msg.msg_iovlen = 1;
+        if (io != -1) {
+            msg.msg_control    = ctl;
+            msg.msg_controllen = sizeof(ctl);
+            cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type  = SCM_RIGHTS;
+            cm->cmsg_len   = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cm), &io, sizeof(int));
+        }
+        if (sendmsg(fd, &msg, 0) == -1)
+            fatal("%s: %s\n", path, strerror(errno));
+        if (opened)
+            close(io);
+
+        /* the reply */
+        for (n = 0; n < sizeof(line) - 1 && read(fd, line + n, 1) == 1 &&
+                    line[n] != '\n'; n++)
+            ;
+        line[n] = 0;
+        seconds[i] = (e = strstr(line, "\"seconds\":")) ? atof(e + 10) : 0;
+        if (!strstr(line, "\"status\":\"ok\"")) {
+            if ((e = strstr(line, "\"error\":\""))) {
+                e += 9;
+                e[strcspn(e, "\"")] = 0;
+            }
+            r = fail("%s\n", e ? e : "no reply from daemon");
+        }
+    }
+    close(fd);
+    if (nsteps > 1)
+        summary(seconds, r ? i - 1 : nsteps);
+    return r;
+}
+
+#endif
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        { "all",       no_argument,       NULL, 'a' },
+        { "device",    required_argument, NULL, 'd' },
+        { "emulate",   required_argument, NULL, 'X' },
+        { "input",     required_argument, NULL, 'i' },
+        { "output",    required_argument, NULL, 'o' },
+        { "xfer-size", required_argument, NULL, 's' },
+        { "sparse",    no_argument,       NULL, 'S' },
+        { "erased",    no_argument,       NULL, 'E' },
+        { "delta",     no_argument,       NULL, 'D' },
+        { "verify",    no_argument,       NULL, 'V' },
+        { "retry",     required_argument, NULL, 'R' },
+        { "cache",     required_argument, NULL, 'C' },
+        { "batch",     required_argument, NULL, 'b' },
+        { "listen",    required_argument, NULL, 'l' },
+        { "connect",   required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    static struct rkflash_device devs[RKFT_MAX_DEVICES];
+    static struct job jobs[RKFT_MAX_DEVICES];
+    const char *batch = NULL, *listening = NULL, *connecting = NULL;
+    int ch, i, k, ndevs, njobs = 0;
+
+    info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR,
+                                 RKFLASHTOOL_VERSION_MINOR);
+
+    while ((ch = getopt_long(argc, argv, "ad:X:i:o:s:SEDVR:C:b:l:c:", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'a':
+            all = 1;
+            break;
+        case 'd':
+            if (nselected == RKFT_MAX_DEVICES)
+                fatal("too many devices\n");
+            selected[nselected++] = optarg;
+            break;
+        case 'X':
+            if (nemulated == RKFT_MAX_DEVICES)
+                fatal("too many devices\n");
+            emulated[nemulated++] = optarg;
+            break;
+        case 'i':
+            infile = optarg;
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 's':
+        case 'S':
+        case 'E':
+        case 'D':
+        case 'R':
+        case 'V':
+            if (set_option(&options, ch, optarg))
+                exit(1);
+            break;
+        case 'C':
+            cachedir = optarg;
+            break;
+        case 'b':
+            batch = optarg;
+            break;
+        case 'l':
+            listening = optarg;
+            break;
+        case 'c':
+            connecting = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (listening) {
+        if (argc || batch || connecting) usage();
+    } else if (!argc && !batch) usage();
+
+    if (batch) {
+        if (argc) usage();
+        read_script(batch);
+    } else {
+        /* steps on the command line are separated by , */
+        while (argc) {
+            for (k = 0; k < argc && strcmp(argv[k], ","); k++)
+                ;
+            if (nsteps == RKFT_MAX_STEPS)
+                fatal("too many steps\n");
+            if (parse_step(k, argv, &steps[nsteps++]))
+                usage();
+            argc -= k;
+            argv += k;
+            if (argc)
+                NEXT;
+        }
+    }
+
+    /* the device is gone after these */
+    for (i = 0; i < nsteps - 1; i++)
+        if (strchr("bL", steps[i].action))
+            fatal("%s must be the last step\n", steps[i].text);
+
+#ifdef _WIN32
+    if (listening || connecting)
+        fatal("-l and -c are not supported on this platform\n");
+#else
+    /* the daemon has the devices */
+    if (connecting)
+        return client(connecting);
+#endif
+
+    /* Emulated devices replace USB ones */
+
+    for (i = 0; i < nemulated; i++) {
+        snprintf(jobs[njobs].path, sizeof(jobs[njobs].path), "emu%d", i);
+        jobs[njobs++].spec = emulated[i];
+    }
+
+    /* Detect connected RockChip devices */
+
+    if (nemulated)
+        ndevs = 0;
+    else if ((ndevs = rkflash_list(devs, RKFT_MAX_DEVICES)) < 0)
+        fatal("cannot get device list\n");
+    if (ndevs > RKFT_MAX_DEVICES)
+        ndevs = RKFT_MAX_DEVICES;
+
+    for (i = 0; i < ndevs; i++) {
+        for (k = 0; k < nselected && strcmp(selected[k], devs[i].path); k++)
+            ;
+        if (nselected && k == nselected)
+            continue;
+        strcpy(jobs[njobs++].path, devs[i].path);
+
+        /* without -a or -d, the first device found is used */
+        if (!all && !nselected && !listening)
+            break;
+    }
+    for (i = 0; i < njobs; i++)
+        jobs[i].opts = options;
+
+#ifndef _WIN32
+    if (listening)
+        serve(listening, jobs, njobs);
+#endif
+    if (!njobs) fatal("cannot open device\n");
+
+    if (njobs > 1) {
+        for (i = 0; i < nsteps; i++) {
+            if (!infile && !steps[i].infile && strchr(inputs, steps[i].action))
+                fatal("-i is needed with several devices\n");
+            if (!outfile && !steps[i].outfile && strchr(outputs, steps[i].action))
+                fatal("-o is needed with several devices\n");
+        }
+        run_parallel(jobs, njobs);
+        return 0;
+    }
+
+    return run(&jobs[0]);
+}
@@ -0,0 +1,793 @@
+/* rkpack - build RKAF, RKFW and RKFP images
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The layouts are the ones rkunpack takes apart:
+ *
+ * RKAF     0x800 byte header with up to 16 entries of 0x70 bytes, the
+ *          files at 0x800 byte boundaries, and the rkcrc32 of all that
+ * RKFW     0x66 byte header, the loader (BOOT), an RKAF image, and the
+ *          MD5 of all that in hex
+ * RKFP     a header sector, the entry table and its backup, and the
+ *          files at sector boundaries
+ *
+ * The manifest has one keyword or entry per line, # starts a comment:
+ *
+ * format rkaf|rkfw|rkfp            default rkaf
+ * model, id, manufacturer string   RKAF header strings
+ * version major.minor.build        RKAF, RKFW and RKFP version
+ * chip rk29xx|...|number           RKFW chip family
+ * loader path                      RKFW loader
+ * sector size                      RKFP sector size, default 512
+ * name path [type [property]]      an entry, type and property for RKFP
+ *
+ * Keywords that do not apply to the format are an error, wherever the
+ * format line is.
+ * Paths are relative to the manifest and stored as given, so they are
+ * where rkunpack puts the files. A path of SELF or RESERVED adds an RKAF
+ * entry without data. The parameter entry is stored with its PARM header
+ * and CRC, and its mtdparts give the flash address and size of the other
+ * entries.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE     /* copy_file_range, fallocate */
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rkcrc.h"
+#include "rkflashtool.h"
+#include "version.h"
+
+#ifndef _WIN32
+#define O_BINARY 0
+#endif
+
+#define PUT16LE(x, y) do { (x)[0] = (y) & 0xff; (x)[1] = ((y) >> 8) & 0xff; } while (0)
+
+#define RKAF_HEADER     0x800
+#define RKAF_ENTRY      0x70
+#define RKAF_MAX        16
+#define RKFW_HEADER     0x66
+#define RKFP_ENTRY      0x40
+#define RKFP_MAX        0x100
+
+#define CHUNK_SIZE      0x1000000   /* of the CRC */
+#define COPY_BUFSIZE    0x100000
+
+static const char *const strings[2] = { "info", "fatal" };
+
+static void info_and_fatal(const int s, const char *f, ...) {
+    va_list ap;
+    va_start(ap,f);
+    fprintf(stderr, "rkpack: %s: ", strings[s]);
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+    if (s) exit(s);
+}
+
+#define info(...)   info_and_fatal(0, __VA_ARGS__)
+#define fatal(...)  info_and_fatal(1, __VA_ARGS__)
+
+/* Manifest */
+
+enum { RKAF, RKFW, RKFP };
+
+struct input {
+    char name[PATH_MAX];
+    int fd;
+    const uint8_t *data;    /* mapped */
+    uint64_t size;
+};
+
+struct part {
+    char name[0x20 + 1];
+    char path[0x3c + 1];
+    struct input in;
+    uint32_t type, property;
+};
+
+static int format = RKAF;
+static char model[0x22 + 1], id[0x1e + 1], manufacturer[0x38 + 1];
+static uint32_t version, chip, sector = 512;
+static struct input loader;
+static struct part parts[RKFP_MAX];
+static int nparts;
+
+static void open_input(struct input *in, const char *dir, const char *path) {
+    struct stat st;
+
+    if (path[0] == '/' || !dir[0])
+        snprintf(in->name, sizeof(in->name), "%s", path);
+    else
+        snprintf(in->name, sizeof(in->name), "%s/%s", dir, path);
+
+    if ((in->fd = open(in->name, O_BINARY | O_RDONLY)) == -1 ||
+        fstat(in->fd, &st) == -1)
+        fatal("%s: %s\n", in->name, strerror(errno));
+    if (!S_ISREG(st.st_mode))
+        fatal("%s: not a regular file\n", in->name);
+    if (st.st_size > 0xffffffffLL)
+        fatal("%s: larger than 4GB\n", in->name);
+
+    in->size = st.st_size;
+    in->data = NULL;
+    if (in->size &&
+        (in->data = mmap(NULL, in->size, PROT_READ, MAP_SHARED, in->fd, 0)) == MAP_FAILED)
+        fatal("%s: %s\n", in->name, strerror(errno));
+}
+
+static uint32_t parse_version(const char *s) {
+    unsigned int major = 0, minor = 0, build = 0;
+
+    if (sscanf(s, "%u.%u.%u", &major, &minor, &build) < 1 ||
+        major > 0xff || minor > 0xff || build > 0xffff)
+        fatal("invalid version '%s'\n", s);
+    return major << 24 | minor << 16 | build;
+}
+
+static uint32_t parse_chip(const char *s) {
+    static const struct { const char *name; uint32_t code; } chips[] = {
+        { "rk29xx", 0x50 }, { "rk30xx", 0x60 }, { "rk31xx", 0x70 },
+        { "rk32xx", 0x80 }, { "rk3368", 0x41 },
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(chips) / sizeof(chips[0]); i++)
+        if (!strcmp(s, chips[i].name))
+            return chips[i].code;
+    return strtoul(s, NULL, 0);
+}
+
+/* Header keywords and entry fields that only some formats have */
+struct format_use {
+    const char *what;
+    int line;
+    int formats;        /* bit mask of the formats it applies to */
+};
+
+#define RKAF_HEADERS    (1 << RKAF | 1 << RKFW)
+
+static struct format_use uses[8];
+static int nuses;
+
+/* Notes the first use of what, to check it against the format at the end */
+static void use(const char *what, int line, int formats) {
+    int i;
+
+    for (i = 0; i < nuses && strcmp(uses[i].what, what); i++)
+        ;
+    if (i == nuses) {
+        uses[nuses].what    = what;
+        uses[nuses].line    = line;
+        uses[nuses].formats = formats;
+        nuses++;
+    }
+}
+
+static void read_manifest(const char *name) {
+    char line[1024], dir[PATH_MAX], *arg[5], *p, *sep;
+    struct part *part;
+    FILE *f;
+    int i, n, lineno = 0;
+
+    if (!(f = fopen(name, "r")))
+        fatal("%s: %s\n", name, strerror(errno));
+
+    snprintf(dir, sizeof(dir), "%s", name);
+    if ((sep = strrchr(dir, '/')))
+        *sep = '\0';
+    else
+        dir[0] = '\0';
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        for (n = 0, p = strtok(line, " \t\r\n"); p && n < 5; p = strtok(NULL, " \t\r\n"))
+            arg[n++] = p;
+        if (!n)
+            continue;
+        if (n < 2)
+            fatal("%s:%d: missing argument\n", name, lineno);
+
+        if (!strcmp(arg[0], "format")) {
+            if      (!strcmp(arg[1], "rkaf")) format = RKAF;
+            else if (!strcmp(arg[1], "rkfw")) format = RKFW;
+            else if (!strcmp(arg[1], "rkfp")) format = RKFP;
+            else fatal("%s:%d: unknown format '%s'\n", name, lineno, arg[1]);
+        } else if (!strcmp(arg[0], "model")) {
+            use("model", lineno, RKAF_HEADERS);
+            snprintf(model, sizeof(model), "%s", arg[1]);
+        } else if (!strcmp(arg[0], "id")) {
+            use("id", lineno, RKAF_HEADERS);
+            snprintf(id, sizeof(id), "%s", arg[1]);
+        } else if (!strcmp(arg[0], "manufacturer")) {
+            use("manufacturer", lineno, RKAF_HEADERS);
+            snprintf(manufacturer, sizeof(manufacturer), "%s", arg[1]);
+        } else if (!strcmp(arg[0], "version")) {
+            version = parse_version(arg[1]);
+        } else if (!strcmp(arg[0], "chip")) {
+            use("chip", lineno, 1 << RKFW);
+            chip = parse_chip(arg[1]);
+        } else if (!strcmp(arg[0], "loader")) {
+            use("loader", lineno, 1 << RKFW);
+            open_input(&loader, dir, arg[1]);
+        } else if (!strcmp(arg[0], "sector")) {
+            use("sector", lineno, 1 << RKFP);
+            if ((sector = strtoul(arg[1], NULL, 0)) < 512 || sector & (sector - 1))
+                fatal("%s:%d: invalid sector size\n", name, lineno);
+        } else {
+            if (n > 2)
+                use("entry type and property", lineno, 1 << RKFP);
+            if (nparts == RKFP_MAX)
+                fatal("%s:%d: too many entries\n", name, lineno);
+            if (strlen(arg[0]) >= sizeof(part->name) || strlen(arg[1]) >= sizeof(part->path))
+                fatal("%s:%d: name or path too long\n", name, lineno);
+
+            part = &parts[nparts++];
+            strcpy(part->name, arg[0]);
+            strcpy(part->path, arg[1]);
+            part->type     = n > 2 ? strtoul(arg[2], NULL, 0) : 0;
+            part->property = n > 3 ? strtoul(arg[3], NULL, 0) : 0;
+            part->in.fd    = -1;
+            if (strcmp(part->path, "SELF") && strcmp(part->path, "RESERVED"))
+                open_input(&part->in, dir, part->path);
+        }
+    }
+    fclose(f);
+
+    for (i = 0; i < nuses; i++)
+        if (!(uses[i].formats & 1 << format))
+            fatal("%s:%d: %s does not apply to %s images\n", name, uses[i].line,
+                  uses[i].what, format == RKAF ? "RKAF" : format == RKFW ? "RKFW" : "RKFP");
+
+    if (!nparts)
+        fatal("%s: no entries\n", name);
+    if (format != RKFP && nparts > (int)RKAF_MAX)
+        fatal("%s: RKAF images hold at most %d entries\n", name, (int)RKAF_MAX);
+    if (format == RKFW && (loader.size < 4 || memcmp(loader.data, "BOOT", 4)))
+        fatal("%s: RKFW images need a loader line, with a file starting with BOOT\n", name);
+}
+
+/* Flash address and size in sectors of partition name in the mtdparts of
+ * the parameter file, a size of 0 meaning up to the end of the flash.
+ */
+static int find_partition(const char *mtdparts, const char *name,
+                          uint32_t *addr, uint32_t *size) {
+    char exp[0x24];
+    const char *par, *p;
+
+    snprintf(exp, sizeof(exp), "(%s)", name);
+    if (!mtdparts || !(par = strstr(mtdparts, exp)))
+        return -1;
+    for (p = par; p > mtdparts && p[-1] != ',' && p[-1] != ':'; p--)
+        ;
+    *size = *p == '-' ? 0 : strtoul(p, NULL, 0);
+    if (!(p = memchr(p, '@', par - p)))
+        return -1;
+    *addr = strtoul(p + 1, NULL, 0);
+    return 0;
+}
+
+/* Layout
+ *
+ * The image is a list of pieces at increasing offsets: buffers made here
+ * (headers, the wrapped parameter file, the CRC), input files, and zeros
+ * to pad them, which are only holes in the preallocated output. The ones
+ * the RKAF CRC covers are split into chunks that a pool of threads does
+ * while the main thread copies the pieces into place, and the chunk CRCs
+ * are combined afterwards. RKFW adds a thread doing the MD5, in order.
+ */
+
+struct piece {
+    uint64_t offset;        /* in the output */
+    uint64_t size;
+    const uint8_t *data;    /* NULL for zeros */
+    int fd;                 /* the input file data is mapped from, or -1 */
+    int crc;                /* covered by the RKAF CRC */
+};
+
+struct chunk {
+    const uint8_t *data;
+    uint64_t size;
+    uint32_t crc;
+};
+
+static struct piece pieces[2 * RKFP_MAX + 8];
+static int npieces;
+static uint64_t total;
+
+static struct chunk *chunks;
+static int nchunks, next_chunk;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t *zalloc(size_t size) {
+    uint8_t *p;
+
+    if (!(p = calloc(1, size)))
+        fatal("out of memory\n");
+    return p;
+}
+
+static struct piece *add_piece(const uint8_t *data, uint64_t size, int fd, int crc) {
+    struct piece *p = &pieces[npieces++];
+
+    p->offset = total;
+    p->size   = size;
+    p->data   = data;
+    p->fd     = fd;
+    p->crc    = crc;
+    total += size;
+    return p;
+}
+
+/* pads to a multiple of align from base */
+static void pad(uint64_t base, uint64_t align, int crc) {
+    if ((total - base) % align)
+        add_piece(NULL, align - (total - base) % align, -1, crc);
+}
+
+static void set_date(uint8_t *p) {
+    time_t t = time(NULL);
+    struct tm *tm = localtime(&t);
+
+    PUT16LE(p, tm->tm_year + 1900);
+    p[2] = tm->tm_mon + 1;
+    p[3] = tm->tm_mday;
+    p[4] = tm->tm_hour;
+    p[5] = tm->tm_min;
+    p[6] = tm->tm_sec;
+}
+
+/* Lays out an RKAF image at the current end and returns its CRC piece */
+static struct piece *layout_rkaf(void) {
+    uint8_t *hdr = zalloc(RKAF_HEADER), *e, *parm;
+    uint64_t base = total, pos;
+    char *mtdparts = NULL;
+    struct part *part;
+    uint32_t addr, size, crc;
+    int i;
+
+    memcpy(hdr, "RKAF", 4);
+    memcpy(hdr + 0x08, model, strlen(model));
+    memcpy(hdr + 0x2a, id, strlen(id));
+    memcpy(hdr + 0x48, manufacturer, strlen(manufacturer));
+    PUT32LE(hdr + 0x84, version);
+    PUT32LE(hdr + 0x88, nparts);
+    add_piece(hdr, RKAF_HEADER, -1, 1);
+
+    for (part = parts; part < parts + nparts; part++) {
+        if (!strcmp(part->name, "parameter") && part->in.size) {
+            mtdparts = (char *)zalloc(part->in.size + 1);
+            memcpy(mtdparts, part->in.data, part->in.size);
+            mtdparts = strstr(mtdparts, "mtdparts=");
+        }
+    }
+
+    for (i = 0, part = parts; part < parts + nparts; part++, i++) {
+        e = hdr + 0x8c + i * RKAF_ENTRY;
+        memcpy(e, part->name, strlen(part->name));
+        memcpy(e + 0x20, part->path, strlen(part->path));
+
+        if (!strcmp(part->name, "parameter")) {
+            addr = 0;
+            size = 0x2000;
+        } else if (find_partition(mtdparts, part->name, &addr, &size)) {
+            addr = 0xffffffff;
+            size = 0;
+        }
+        PUT32LE(e + 0x5c, size);
+        PUT32LE(e + 0x64, addr);
+
+        if (part->in.fd == -1)
+            continue;
+
+        pos = total - base;
+        if (!strcmp(part->name, "parameter")) {
+            /* stored as rkcrc -p would, rkunpack strips it again */
+            parm = zalloc(part->in.size + 12);
+            memcpy(parm, "PARM", 4);
+            PUT32LE(parm + 4, part->in.size);
+            memcpy(parm + 8, part->in.data, part->in.size);
+            crc = rkcrc32(0, parm + 8, part->in.size);
+            PUT32LE(parm + 8 + part->in.size, crc);
+            add_piece(parm, part->in.size + 12, -1, 1);
+        } else {
+            add_piece(part->in.data, part->in.size, part->in.fd, 1);
+        }
+        PUT32LE(e + 0x60, pos);
+        PUT32LE(e + 0x6c, total - base - pos);
+        pad(base, 0x800, 1);
+        PUT32LE(e + 0x68, total - base - pos);
+    }
+
+    if (total - base > 0xffffffff)
+        fatal("RKAF image larger than 4GB\n");
+    PUT32LE(hdr + 4, total - base);
+    return add_piece(zalloc(4), 4, -1, 0);
+}
+
+static struct piece *layout_rkfw(void) {
+    uint8_t *hdr = zalloc(RKFW_HEADER);
+    uint64_t rkaf;
+    struct piece *crc;
+
+    memcpy(hdr, "RKFW", 4);
+    PUT16LE(hdr + 4, RKFW_HEADER);
+    PUT32LE(hdr + 6, version);
+    set_date(hdr + 0x0e);
+    PUT32LE(hdr + 0x15, chip);
+    add_piece(hdr, RKFW_HEADER, -1, 0);
+
+    PUT32LE(hdr + 0x19, total);
+    PUT32LE(hdr + 0x1d, loader.size);
+    add_piece(loader.data, loader.size, loader.fd, 0);
+
+    rkaf = total;
+    crc = layout_rkaf();
+    if (total > 0xffffffff)
+        fatal("RKFW image larger than 4GB\n");
+    PUT32LE(hdr + 0x21, rkaf);
+    PUT32LE(hdr + 0x25, total - rkaf);
+
+    add_piece(zalloc(32), 32, -1, 0);     /* MD5 */
+    return crc;
+}
+
+static void layout_rkfp(void) {
+    uint32_t table = (nparts * RKFP_ENTRY + sector - 1) / sector;
+    uint8_t *hdr = zalloc(sector), *tab = zalloc(table * sector), *e;
+    uint32_t crc, start;
+    int i;
+
+    memcpy(hdr, "RKFP", 4);
+    set_date(hdr + 4);
+    PUT32LE(hdr + 12, version);
+    PUT32LE(hdr + 0x10, sector);
+    PUT32LE(hdr + 0x14, 1);
+    PUT32LE(hdr + 0x18, 1 + table);
+    PUT32LE(hdr + 0x1c, RKFP_ENTRY);
+    PUT32LE(hdr + 0x20, nparts);
+    add_piece(hdr, sector, -1, 0);
+    add_piece(tab, table * sector, -1, 0);
+    add_piece(tab, table * sector, -1, 0);  /* backup */
+
+    for (i = 0; i < nparts; i++) {
+        if (strlen(parts[i].path) > 0x1f)
+            fatal("%s: RKFP paths are at most 31 characters\n", parts[i].path);
+        if (parts[i].in.fd == -1)
+            fatal("%s: RKFP entries need data\n", parts[i].name);
+
+        e = tab + i * RKFP_ENTRY;
+        memcpy(e, parts[i].path, strlen(parts[i].path));
+        PUT32LE(e + 32, parts[i].type);
+        start = total / sector;
+        PUT32LE(e + 36, start);
+        PUT32LE(e + 44, parts[i].in.size);
+        PUT32LE(e + 48, parts[i].property);
+        add_piece(parts[i].in.data, parts[i].in.size, parts[i].in.fd, 0);
+        pad(0, sector, 0);
+        PUT32LE(e + 40, total / sector - start);
+    }
+
+    if (total > 0xffffffff)
+        fatal("RKFP image larger than 4GB\n");
+    PUT32LE(hdr + 0x24, total);
+
+    /* nothing else reads these, they are done like the RKAF one */
+    crc = rkcrc32(0, tab, nparts * RKFP_ENTRY);
+    PUT32LE(hdr + 504, crc);
+    crc = rkcrc32(0, hdr, 508);
+    PUT32LE(hdr + 508, crc);
+}
+
+/* MD5 (RFC 1321) */
+
+struct md5 {
+    uint32_t h[4];
+    uint64_t len;
+    uint8_t buf[64];
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21,
+};
+
+static void md5_block(struct md5 *m, const uint8_t *p) {
+    uint32_t a = m->h[0], b = m->h[1], c = m->h[2], d = m->h[3], f, t, w[16];
+    int i, g;
+
+    for (i = 0; i < 16; i++)
+        w[i] = p[4*i] | p[4*i+1] << 8 | p[4*i+2] << 16 | (uint32_t)p[4*i+3] << 24;
+
+    for (i = 0; i < 64; i++) {
+        switch (i >> 4) {
+        case 0:  f = (b & c) | (~b & d); g = i;                break;
+        case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) & 15; break;
+        case 2:  f = b ^ c ^ d;          g = (3 * i + 5) & 15; break;
+        default: f = c ^ (b | ~d);       g = (7 * i) & 15;     break;
+        }
+        t = a + f + md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += t << md5_r[(i >> 4) * 4 + (i & 3)] | t >> (32 - md5_r[(i >> 4) * 4 + (i & 3)]);
+    }
+
+    m->h[0] += a;
+    m->h[1] += b;
+    m->h[2] += c;
+    m->h[3] += d;
+}
+
+static void md5_init(struct md5 *m) {
+    m->h[0] = 0x67452301;
+    m->h[1] = 0xefcdab89;
+    m->h[2] = 0x98badcfe;
+    m->h[3] = 0x10325476;
+    m->len  = 0;
+}
+
+static void md5_update(struct md5 *m, const uint8_t *p, uint64_t size) {
+    unsigned int n, used = m->len & 63;
+
+    m->len += size;
+    if (used) {
+        n = size < 64 - used ? size : 64 - used;
+        memcpy(m->buf + used, p, n);
+        p += n;
+        size -= n;
+        if (used + n < 64)
+            return;
+        md5_block(m, m->buf);
+    }
+    for (; size >= 64; p += 64, size -= 64)
+        md5_block(m, p);
+    memcpy(m->buf, p, size);
+}
+
+static void md5_hex(struct md5 *m, char *hex) {
+    static const uint8_t padding[64] = { 0x80 };
+    uint64_t bits = m->len * 8;
+    uint8_t len[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        len[i] = bits >> (8 * i);
+    md5_update(m, padding, 1 + (119 - (m->len & 63)) % 64);
+    md5_update(m, len, 8);
+
+    for (i = 0; i < 16; i++)
+        sprintf(hex + 2 * i, "%02x", (m->h[i / 4] >> (8 * (i % 4))) & 0xff);
+}
+
+/* Output */
+
+static void *crc_worker(void *arg) {
+    struct chunk *c;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&chunk_lock);
+        c = next_chunk < nchunks ? &chunks[next_chunk++] : NULL;
+        pthread_mutex_unlock(&chunk_lock);
+        if (!c)
+            return NULL;
+        c->crc = c->data ? rkcrc32(0, (uint8_t *)c->data, c->size) : 0;
+    }
+}
+
+/* MD5 of all pieces but the last two, the RKAF CRC and the MD5 itself */
+static void *md5_worker(void *arg) {
+    static const uint8_t zeros[4096];
+    struct md5 *m = arg;
+    struct piece *p;
+    uint64_t n, left;
+
+    md5_init(m);
+    for (p = pieces; p < pieces + npieces - 2; p++) {
+        if (p->data) {
+            md5_update(m, p->data, p->size);
+        } else {
+            for (left = p->size; left; left -= n) {
+                n = left < sizeof(zeros) ? left : sizeof(zeros);
+                md5_update(m, zeros, n);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void put(int out, const char *name, const uint8_t *data, uint64_t size,
+                uint64_t offset) {
+    ssize_t nw;
+
+    for (; size; data += nw, size -= nw, offset += nw) {
+#ifdef _WIN32
+        if (lseek(out, offset, SEEK_SET) == -1)
+            fatal("%s: %s\n", name, strerror(errno));
+        nw = write(out, data, size < COPY_BUFSIZE ? size : COPY_BUFSIZE);
+#else
+        nw = pwrite(out, data, size < COPY_BUFSIZE ? size : COPY_BUFSIZE, offset);
+#endif
+        if (nw <= 0)
+            fatal("%s: %s\n", name, strerror(errno ? errno : EIO));
+    }
+}
+
+static void copy_piece(int out, const char *name, const struct piece *p) {
+    uint64_t done = 0;
+#ifdef __linux__
+    loff_t in_off = 0, out_off = p->offset;
+    ssize_t nr;
+
+    /* the kernel copies, or shares the extents where it can */
+    if (p->fd != -1)
+        while (done < p->size &&
+               (nr = copy_file_range(p->fd, &in_off, out, &out_off,
+                                     p->size - done, 0)) > 0)
+            done += nr;
+#endif
+    put(out, name, p->data + done, p->size - done, p->offset + done);
+}
+
+static void write_image(const char *name, struct piece *crcp, int njobs) {
+    pthread_t *threads, md5_thread;
+    struct md5 md5;
+    struct piece *p;
+    struct chunk *c;
+    uint64_t off;
+    uint32_t crc = 0;
+    char hex[33];
+    int out, i;
+
+    if ((out = open(name, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        fatal("%s: %s\n", name, strerror(errno));
+    if (ftruncate(out, total) == -1)
+        fatal("%s: %s\n", name, strerror(errno));
+#ifdef __linux__
+    fallocate(out, 0, 0, total);    /* a hint, holes are fine too */
+#endif
+
+    for (p = pieces; p < pieces + npieces; p++)
+        if (p->crc)
+            nchunks += (p->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    chunks = calloc(nchunks ? nchunks : 1, sizeof(*chunks));
+    threads = calloc(njobs, sizeof(*threads));
+    if (!chunks || !threads)
+        fatal("out of memory\n");
+    for (c = chunks, p = pieces; p < pieces + npieces; p++) {
+        for (off = 0; p->crc && off < p->size; off += CHUNK_SIZE, c++) {
+            c->data = p->data ? p->data + off : NULL;
+            c->size = p->size - off < CHUNK_SIZE ? p->size - off : CHUNK_SIZE;
+        }
+    }
+
+    if (crcp)
+        for (i = 0; i < njobs; i++)
+            if (pthread_create(&threads[i], NULL, crc_worker, NULL))
+                fatal("cannot create thread\n");
+    if (format == RKFW && pthread_create(&md5_thread, NULL, md5_worker, &md5))
+        fatal("cannot create thread\n");
+
+    for (p = pieces; p < pieces + npieces; p++)
+        if (p->data && p->size)
+            copy_piece(out, name, p);
+
+    if (crcp) {
+        for (i = 0; i < njobs; i++)
+            pthread_join(threads[i], NULL);
+        for (c = chunks; c < chunks + nchunks; c++)
+            crc = rkcrc32_combine(crc, c->crc, c->size);
+        PUT32LE((uint8_t *)crcp->data, crc);
+        put(out, name, crcp->data, 4, crcp->offset);
+        info("RKAF CRC: %08x\n", crc);
+    }
+
+    if (format == RKFW) {
+        pthread_join(md5_thread, NULL);
+        md5_update(&md5, crcp->data, 4);
+        md5_hex(&md5, hex);
+        put(out, name, (uint8_t *)hex, 32, total - 32);
+        info("MD5: %s\n", hex);
+    }
+
+    if (close(out) == -1)
+        fatal("%s: %s\n", name, strerror(errno));
+    free(threads);
+    free(chunks);
+}
+
+int main(int argc, char *argv[]) {
+    char *progname = argv[0];
+    struct piece *crc = NULL;
+    int ch, njobs = 1;
+
+    while ((ch = getopt(argc, argv, "j:")) != -1) {
+        switch (ch) {
+        case 'j':
+            if ((njobs = atoi(optarg)) <= 0)
+                njobs = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        default:
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2)
+        fatal("rkpack v%d.%d\nusage: %s [-j threads] manifest outfile\n",
+               RKFLASHTOOL_VERSION_MAJOR,
+               RKFLASHTOOL_VERSION_MINOR, progname);
+
+    read_manifest(argv[0]);
+
+    switch (format) {
+    case RKAF: crc = layout_rkaf(); break;
+    case RKFW: crc = layout_rkfw(); break;
+    case RKFP: layout_rkfp();       break;
+    }
+    info("%d entries, %llu bytes\n", nparts, (unsigned long long)total);
+
+    write_image(argv[1], crc, njobs);
+    printf("packed\n");
+
+    return 0;
+}
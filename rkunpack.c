@@ -25,6 +25,10 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* copy_file_range */
+#endif
+
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -32,6 +36,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,20 +44,32 @@
 #include <unistd.h>
 #include "version.h"
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #ifdef _WIN32       /* hack around non-posix behaviour */
 #undef mkdir
 #define mkdir(a,b) _mkdir(a)
 int _mkdir(const char *);
 #include <windows.h>
+#include <io.h>
 HANDLE fm;
 #else
 #define O_BINARY 0
 #endif
 
-static uint8_t *buf;
-static off_t size;
+static uint8_t *buf;        /* the image, or what has been read of a stream */
+static off_t size;          /* bytes in buf */
 static unsigned int fsize, ioff, isize, noff;
 static int fd;
+static int njobs = 1;
+static int streaming;
+static int recursive;
+static int list;            /* 1 for text, 2 for JSON */
+static int selective;       /* only the entries named on the command line */
+static unsigned int rkaf_size;      /* checked once a stream has ended */
 
 static const char *const strings[2] = { "info", "fatal" };
 
@@ -68,38 +85,426 @@ static void info_and_fatal(const int s, const char *f, ...) {
 #define info(...)   info_and_fatal(0, __VA_ARGS__)
 #define fatal(...)  info_and_fatal(1, __VA_ARGS__)
 
+/* Streaming
+ *
+ * Images that cannot be mapped, like pipes, are read sequentially. The
+ * headers and entry tables are read into buf as far as the unpack
+ * functions need() them, up to HEADER_MAX. Entries are then filled from
+ * buf and from the rest of the stream in STREAM_BUFSIZE pieces, every
+ * piece going to all entries it overlaps, so nothing else is kept.
+ */
+
+#define HEADER_MAX      0x1000000
+#define STREAM_BUFSIZE  0x100000
+
+static void need(uint64_t end) {
+    static size_t alloc;
+    ssize_t nr;
+
+    if (end <= (uint64_t)size)
+        return;
+    if (!streaming)
+        fatal("image truncated (%llu bytes needed)\n", (unsigned long long)end);
+    if (end > HEADER_MAX)
+        fatal("headers end beyond the first %d MB, cannot stream this image\n",
+              HEADER_MAX >> 20);
+
+    if (end > alloc) {
+        alloc = (end + 0xffff) & ~0xffff;
+        if (!(buf = realloc(buf, alloc)))
+            fatal("out of memory\n");
+    }
+    while ((uint64_t)size < end) {
+        if ((nr = read(fd, buf + size, end - size)) <= 0)
+            fatal("image truncated (%llu bytes needed)\n", (unsigned long long)end);
+        size += nr;
+    }
+}
+
 #define GET32LE(x) ((x)[0] | (x)[1] << 8 | (x)[2] << 16 | (x)[3] << 24)
 
-static void write_file(const char *path, uint8_t *buffer, unsigned int length) {
-    int img;
-    if ((img = open(path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
-               write(img, buffer, length) == -1 ||
-               close(img) == -1)
-        fatal("%s: %s\n", path, strerror(errno));
+/* Extraction
+ *
+ * The unpack functions only log the entries and add them to a list. The
+ * directories and files are then created in one go and the data is
+ * written by njobs threads, in ranges of at most RANGE_SIZE so large
+ * entries are spread over several of them.
+ */
+
+#define RANGE_SIZE  0x4000000
+
+struct entry {
+    char path[0x48];
+    char name[0x48];
+    char type[8];
+    uint64_t offset;        /* in the image */
+    unsigned int size;
+    int fd;
+    unsigned int blksize;   /* of the filesystem it is written to */
+};
+
+struct range {
+    struct entry *e;
+    unsigned int offset, size;
+};
+
+static struct entry *entries;
+static int nentries;
+static struct range *ranges;
+static int nranges, next_range;
+static pthread_mutex_t range_lock = PTHREAD_MUTEX_INITIALIZER;
+static int error_range = -1, error_errno;
+
+static struct entry *add_entry(const char *path, size_t maxlen, uint64_t offset,
+                               unsigned int length) {
+    struct entry *e;
+
+    /* streams are checked when they end */
+    if (!streaming && (offset > (uint64_t)size || length > (uint64_t)size - offset))
+        fatal("%.*s: beyond end of file\n", (int)maxlen, path);
+
+    if (!(nentries & (nentries - 1)) &&
+        !(entries = realloc(entries, (nentries ? nentries * 2 : 1) * sizeof(*entries))))
+        fatal("out of memory\n");
+    e = &entries[nentries++];
+
+    snprintf(e->path, sizeof(e->path), "%.*s", (int)maxlen, path);
+    snprintf(e->name, sizeof(e->name), "%s", e->path);
+    e->type[0] = '\0';
+    e->offset = offset;
+    e->size   = length;
+    e->fd   = -1;
+    return e;
 }
 
-static void unpack_rkaf(void) {
-    uint8_t *p;
-    const char *name, *path, *sep;
+/* Keeps the entries whose path, name or file name is one of names. */
+static void select_entries(char **names, int n) {
+    struct entry *e, *keep = entries;
+    const char *base;
+    int i, *found;
+
+    if (!(found = calloc(n, sizeof(*found))))
+        fatal("out of memory\n");
+
+    for (e = entries; e < entries + nentries; e++) {
+        base = strrchr(e->path, '/') ? strrchr(e->path, '/') + 1 : e->path;
+        for (i = 0; i < n; i++) {
+            if (!strcmp(names[i], e->path) || !strcmp(names[i], e->name) ||
+                !strcmp(names[i], base)) {
+                found[i] = 1;
+                *keep++ = *e;
+                break;
+            }
+        }
+    }
+    nentries = keep - entries;
+
+    for (i = 0; i < n; i++)
+        if (!found[i])
+            fatal("%s: no such entry\n", names[i]);
+    free(found);
+}
+
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Prints the entry table, as text or one JSON object per line. */
+static void print_entries(void) {
+    struct entry *e;
+
+    if (list == 1)
+        printf("%-12s %-10s %-6s %-32s %s\n", "offset", "size", "type", "name", "path");
+
+    for (e = entries; e < entries + nentries; e++) {
+        if (list == 1) {
+            printf("0x%010llx %-10u %-6s %-32s %s\n", (unsigned long long)e->offset,
+                   e->size, e->type, e->name, e->path);
+        } else {
+            printf("{\"name\": ");
+            print_json_string(e->name);
+            printf(", \"path\": ");
+            print_json_string(e->path);
+            printf(", \"offset\": %llu, \"size\": %u, \"type\": \"%s\"}\n",
+                   (unsigned long long)e->offset, e->size, e->type);
+        }
+    }
+}
+
+static void make_dirs(const char *path) {
     char dir[PATH_MAX];
+    const char *sep = path;
+
+    while ((sep = strchr(sep, '/')) != NULL) {
+        memcpy(dir, path, sep - path);
+        dir[sep - path] = '\0';
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+            fatal("%s: %s\n", dir, strerror(errno));
+        sep++;
+    }
+}
+
+/* Lets the kernel copy the start of a range from the image: the block
+ * aligned part is shared with FICLONERANGE on filesystems like btrfs and
+ * XFS, the rest goes through copy_file_range. Returns the bytes done,
+ * which may be 0 when neither is supported.
+ */
+static unsigned int copy_range(struct range *r) {
+    unsigned int done = 0;
+#ifdef __linux__
+    loff_t in  = r->e->offset + r->offset;
+    loff_t out = r->offset;
+    ssize_t nw;
+#ifdef FICLONERANGE
+    struct file_clone_range clone;
+    unsigned int bs = r->e->blksize;
+
+    if (bs && in % bs == 0 && out % bs == 0 && r->size >= bs) {
+        clone.src_fd      = fd;
+        clone.src_offset  = in;
+        clone.src_length  = r->size / bs * bs;
+        clone.dest_offset = out;
+        if (!ioctl(r->e->fd, FICLONERANGE, &clone)) {
+            done = clone.src_length;
+            in  += done;
+            out += done;
+        }
+    }
+#endif
+    while (done < r->size &&
+           (nw = copy_file_range(fd, &in, r->e->fd, &out, r->size - done, 0)) > 0)
+        done += nw;
+#else
+    (void)r;
+#endif
+    return done;
+}
+
+static int write_range(struct range *r) {
+    unsigned int done = copy_range(r);
+    const uint8_t *p = buf + r->e->offset + r->offset + done;
+    unsigned int left = r->size - done;
+    ssize_t nw;
+
+    /* what the kernel could not copy is written from the mapping */
+    while (left) {
+#ifdef _WIN32
+        if (lseek(r->e->fd, p - buf - r->e->offset, SEEK_SET) == -1)
+            return -1;
+        nw = write(r->e->fd, p, left);
+#else
+        nw = pwrite(r->e->fd, p, left, p - buf - r->e->offset);
+#endif
+        if (nw <= 0)
+            return -1;
+        p    += nw;
+        left -= nw;
+    }
+    return 0;
+}
+
+static void *extract_worker(void *arg) {
+    int i;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&range_lock);
+        i = next_range < nranges && error_range < 0 ? next_range++ : -1;
+        pthread_mutex_unlock(&range_lock);
+        if (i < 0)
+            return NULL;
+
+        if (write_range(&ranges[i])) {
+            pthread_mutex_lock(&range_lock);
+            if (error_range < 0) {
+                error_range = i;
+                error_errno = errno ? errno : EIO;
+            }
+            pthread_mutex_unlock(&range_lock);
+        }
+    }
+}
+
+/* Writes the n bytes of the image at pos in p to the entries they overlap.
+ * Each entry gets its bytes in order, so plain writes do.
+ */
+static void feed(const uint8_t *p, uint64_t pos, size_t n) {
+    struct entry *e;
+    uint64_t lo, hi;
+    ssize_t nw;
+
+    for (e = entries; e < entries + nentries; e++) {
+        lo = pos > e->offset ? pos : e->offset;
+        hi = pos + n < e->offset + e->size ? pos + n : e->offset + e->size;
+        for (; lo < hi; lo += nw)
+            if ((nw = write(e->fd, p + (lo - pos), hi - lo)) <= 0)
+                fatal("%s: %s\n", e->path, strerror(errno ? errno : EIO));
+    }
+}
+
+static void extract_stream(void) {
+    struct entry *e;
+    uint8_t *p;
+    uint64_t pos, end = UINT64_MAX;
+    ssize_t nr = 0;
+
+    if (!(p = malloc(STREAM_BUFSIZE)))
+        fatal("out of memory\n");
+
+    /* the rest of the stream is of no use to a selection */
+    if (selective)
+        for (end = 0, e = entries; e < entries + nentries; e++)
+            if (e->offset + e->size > end)
+                end = e->offset + e->size;
+
+    feed(buf, 0, size);
+    for (pos = size; pos < end && (nr = read(fd, p, STREAM_BUFSIZE)) > 0; pos += nr)
+        feed(p, pos, nr);
+    if (nr < 0)
+        fatal("read: %s\n", strerror(errno));
+    free(p);
+
+    for (e = entries; e < entries + nentries; e++)
+        if (e->offset + e->size > pos)
+            fatal("%s: beyond end of file\n", e->path);
+
+    if (selective)
+        return;
+    if (rkaf_size && rkaf_size != pos)
+        info("invalid file size (should be %u bytes)\n", rkaf_size);
+    else if (rkaf_size)
+        info("file size matches (%u bytes)\n", rkaf_size);
+}
+
+/* Cuts the entries into ranges of at most RANGE_SIZE and copies them on
+ * njobs threads.
+ */
+static void extract_ranges(int n) {
+    pthread_t *threads;
+    struct entry *e;
+    unsigned int off;
+    int i;
+
+    if (n && !(ranges = calloc(n, sizeof(*ranges))))
+        fatal("out of memory\n");
+    for (e = entries; e < entries + nentries; e++) {
+        for (off = 0; off < e->size; off += RANGE_SIZE) {
+            ranges[nranges].e      = e;
+            ranges[nranges].offset = off;
+            ranges[nranges].size   = e->size - off < RANGE_SIZE ? e->size - off
+                                                                : RANGE_SIZE;
+            nranges++;
+        }
+    }
+
+#ifdef _WIN32
+    njobs = 1;      /* no pwrite */
+#endif
+    if (njobs > nranges)
+        njobs = nranges;
+    if (njobs <= 1) {
+        extract_worker(NULL);
+    } else {
+        if (!(threads = calloc(njobs, sizeof(*threads))))
+            fatal("out of memory\n");
+        for (i = 0; i < njobs; i++)
+            if (pthread_create(&threads[i], NULL, extract_worker, NULL))
+                fatal("cannot create thread\n");
+        for (i = 0; i < njobs; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    }
+
+    if (error_range >= 0)
+        fatal("%s: %s\n", ranges[error_range].e->path, strerror(error_errno));
+}
+
+static void extract(void) {
+    struct stat st;
+    struct entry *e;
+    int n = 0;
+
+    for (e = entries; e < entries + nentries; e++) {
+        make_dirs(e->path);
+        if ((e->fd = open(e->path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+            fstat(e->fd, &st) == -1)
+            fatal("%s: %s\n", e->path, strerror(errno));
+#ifndef _WIN32
+        e->blksize = st.st_blksize;
+#endif
+        n += (e->size + RANGE_SIZE - 1) / RANGE_SIZE;
+    }
+
+#ifndef _WIN32
+    /* read ahead only what is extracted, on Linux the kernel copies the
+     * data anyway */
+    if (selective && !streaming) {
+        long pagesize = sysconf(_SC_PAGESIZE);
+        uint64_t start;
+
+        madvise(buf, size, MADV_RANDOM);
+        for (e = entries; e < entries + nentries; e++) {
+            start = e->offset & ~(uint64_t)(pagesize - 1);
+            madvise(buf + start, e->offset + e->size - start, MADV_WILLNEED);
+        }
+    }
+#endif
+
+    if (streaming)
+        extract_stream();
+    else
+        extract_ranges(n);
+
+    for (e = entries; e < entries + nentries; e++)
+        if (close(e->fd) == -1)
+            fatal("%s: %s\n", e->path, strerror(errno));
+
+    free(ranges);
+    free(entries);
+}
+
+/* Unpacks the RKAF image of len bytes at base, which is the whole file or
+ * the one embedded in an RKFW image. len is 0 when it is not known yet.
+ */
+static void unpack_rkaf(uint64_t base, uint64_t len) {
+    const uint8_t *rkaf, *p;
+    const char *name, *path;
+    struct entry *e;
     int count;
 
     info("RKAF signature detected\n");
 
-    fsize = GET32LE(buf+4) + 4;
-    if (fsize != (unsigned)size)
+    need(base + 0x8c);
+    rkaf  = buf + base;
+    fsize = GET32LE(rkaf+4) + 4;
+    if (!len)
+        rkaf_size = fsize;
+    else if (fsize != len)
         info("invalid file size (should be %u bytes)\n", fsize);
     else
         info("file size matches (%u bytes)\n", fsize);
 
-    info("manufacturer: %s\n", buf + 0x48);
-    info("model: %s\n", buf + 0x08);
+    info("manufacturer: %s\n", rkaf + 0x48);
+    info("model: %s\n", rkaf + 0x08);
 
-    count = GET32LE(buf+0x88);
+    count = GET32LE(rkaf+0x88);
 
     info("number of files: %d\n", count);
+    if (count < 0 || count > 0x10000)
+        fatal("invalid number of files\n");
+    need(base + 0x8c + count * 0x70);
+    rkaf = buf + base;
 
-    for (p = &buf[0x8c]; count > 0; p += 0x70, count--) {
+    for (p = &rkaf[0x8c]; count > 0; p += 0x70, count--) {
         name = (const char *)p;
         path = (const char *)p + 0x20;
 
@@ -119,16 +524,9 @@ static void unpack_rkaf(void) {
                 fsize -= 12;
             }
 
-            sep = path;
-            while ((sep = strchr(sep, '/')) != NULL) {
-                memcpy(dir, path, sep - path);
-                dir[sep - path] = '\0';
-                if (mkdir(dir, 0755) == -1 && errno != EEXIST)
-                    fatal("%s: %s\n", dir, strerror(errno));
-                sep++;
-            }
-
-            write_file(path, buf+ioff, fsize);
+            e = add_entry(path, 0x40, base + ioff, fsize);
+            snprintf(e->name, sizeof(e->name), "%.*s", 0x20, name);
+            strcpy(e->type, "file");
         }
     }
 }
@@ -137,6 +535,7 @@ static void unpack_rkfw(void) {
     const char *chip = NULL;
 
     info("RKFW signature detected\n");
+    need(0x29);
     info("version: %d.%d.%d\n", buf[9], buf[8], (buf[7]<<8)+buf[6]);
     info("date: %d-%02d-%02d %02d:%02d:%02d\n",
             (buf[0x0f]<<8)+buf[0x0e], buf[0x10], buf[0x11],
@@ -154,20 +553,26 @@ static void unpack_rkfw(void) {
     ioff  = GET32LE(buf+0x19);
     isize = GET32LE(buf+0x1d);
 
+    need((uint64_t)ioff + 4);
     if (memcmp(buf+ioff, "BOOT", 4))
         fatal("cannot find BOOT signature\n");
 
     info("%08x-%08x %-26s (size: %d)\n", ioff, ioff + isize -1, "BOOT", isize);
-    write_file("BOOT", buf+ioff, isize);
+    strcpy(add_entry("BOOT", 4, ioff, isize)->type, "boot");
 
     ioff  = GET32LE(buf+0x21);
     isize = GET32LE(buf+0x25);
 
+    need((uint64_t)ioff + 4);
     if (memcmp(buf+ioff, "RKAF", 4))
         fatal("cannot find embedded RKAF update.img\n");
 
-    info("%08x-%08x %-26s (size: %d)\n", ioff, ioff + isize -1, "embedded-update.img", isize);
-    write_file("embedded-update.img", buf+ioff, isize);
+    if (recursive) {
+        unpack_rkaf(ioff, isize);
+    } else {
+        info("%08x-%08x %-26s (size: %d)\n", ioff, ioff + isize -1, "embedded-update.img", isize);
+        strcpy(add_entry("embedded-update.img", 19, ioff, isize)->type, "rkaf");
+    }
 
 }
 
@@ -175,9 +580,11 @@ static void unpack_rkfp(void) {
     uint8_t *p;
     unsigned int pss, peo, pbeo, pes, pec;
     const char *path;
+    struct entry *e;
     int count;
 
     info("RKFP signature detected\n");
+    need(512);
     info("version: %d.%d.%d\n", buf[15], buf[14], (buf[13]<<8)+buf[12]);
     info("date: %d-%02d-%02d %02d:%02d:%02d\n",
             (buf[0x05]<<8)+buf[0x04], buf[0x06], buf[0x07],
@@ -197,6 +604,10 @@ static void unpack_rkfp(void) {
     info("partition entry crc: %08x\n", GET32LE(buf+504));
     info("header crc: %08x\n", GET32LE(buf+508));
 
+    if (pec > 0x10000)
+        fatal("invalid partition entry count\n");
+    need((uint64_t)pss * peo + (uint64_t)pec * pes);
+
     for (count = 1; count <= GET32LE(buf+0x20); count++) {
 
         p = &buf[pss*peo+(count-1)*pes];
@@ -207,47 +618,104 @@ static void unpack_rkfp(void) {
 
         info("%08x-%08x %-26s (type: %02x) (property: %02x) (size: %d)\n",
             ioff*pss, (ioff + isize)*pss, path, GET32LE(p+32), GET32LE(p+48), fsize);
-        write_file(path, buf+(ioff*pss), fsize);
+        e = add_entry(path, 32, (uint64_t)ioff * pss, fsize);
+        snprintf(e->type, sizeof(e->type), "%02x", GET32LE(p+32) & 0xff);
     }
 
 }
 
 int main(int argc, char *argv[]) {
+    char *progname = argv[0];
+    int ch;
+
+    while ((ch = getopt(argc, argv, "j:lJr")) != -1) {
+        switch (ch) {
+        case 'j':
+            if ((njobs = atoi(optarg)) <= 0)
+                njobs = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'l':
+            list = 1;
+            break;
+        case 'J':
+            list = 2;
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        default:
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
 
-    if (argc != 2)
-        fatal("rkunpack v%d.%d\nusage: %s update.img\n",
+    if (argc < 1)
+        fatal("rkunpack v%d.%d\n"
+              "usage: %s [-r] [-j threads] [-l|-J] update.img|- [entry...]\n",
                RKFLASHTOOL_VERSION_MAJOR,
-               RKFLASHTOOL_VERSION_MINOR, argv[0]);
-
-    if ((fd = open(argv[1], O_BINARY | O_RDONLY)) == -1)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+               RKFLASHTOOL_VERSION_MINOR, progname);
 
-    if ((size = lseek(fd, 0, SEEK_END)) == -1)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+    if (!strcmp(argv[0], "-")) {
+        fd = 0;
+#ifdef _WIN32
+        _setmode(fd, O_BINARY);
+#endif
+    } else if ((fd = open(argv[0], O_BINARY | O_RDONLY)) == -1) {
+        fatal("%s: %s\n", argv[0], strerror(errno));
+    }
 
+    /* pipes, and images too big for the address space, are streamed */
+    if ((size = lseek(fd, 0, SEEK_END)) == -1) {
+        streaming = 1;
+    } else {
 #ifdef _WIN32
-    fm  = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
-    buf = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
-    if (!buf) fatal("%s: cannot create MapView of File\n", argv[1]);
+        fm  = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+        buf = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
+        if (!buf) {
+            CloseHandle(fm);
+            streaming = 1;
+        }
 #else
-    if ((buf = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_FILE, fd, 0))
+        if (size != (off_t)(size_t)size ||
+            (buf = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_FILE, fd, 0))
                                                         == MAP_FAILED)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+            streaming = 1;
 #endif
+        if (streaming && lseek(fd, 0, SEEK_SET) == -1)
+            fatal("%s: %s\n", argv[0], strerror(errno));
+    }
+    if (streaming) {
+        buf  = NULL;
+        size = 0;
+    }
 
-         if (!memcmp(buf, "RKAF", 4)) unpack_rkaf();
+    need(4);
+         if (!memcmp(buf, "RKAF", 4)) unpack_rkaf(0, streaming ? 0 : size);
     else if (!memcmp(buf, "RKFW", 4)) unpack_rkfw();
     else if (!memcmp(buf, "RKFP", 4)) unpack_rkfp();
-    else fatal("%s: invalid signature\n", argv[1]);
+    else fatal("%s: invalid signature\n", argv[0]);
 
-    printf("unpacked\n");
+    if ((selective = argc > 1))
+        select_entries(argv + 1, argc - 1);
 
+    if (list) {
+        print_entries();
+    } else {
+        extract();
+        printf("unpacked\n");
+    }
+
+    if (streaming) {
+        free(buf);
+    } else {
 #ifdef _WIN32
-    CloseHandle(fm);
-    UnmapViewOfFile(buf);
+        CloseHandle(fm);
+        UnmapViewOfFile(buf);
 #else
-    munmap(buf, size);
+        munmap(buf, size);
 #endif
+    }
 
     close(fd);
 